@@ -0,0 +1,2540 @@
+/* 
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <fontconfig/fontconfig.h>
+#include <ft2build.h>
+#include FT_OUTLINE_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <math.h>
+
+#include <cairo-pdf.h>
+#include <cairo-ft.h>
+
+#include <harfbuzz/hb-ft.h>
+#include <harfbuzz/hb-icu.h>
+#include <assert.h>
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <exception>
+#include <memory>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "azlayout.h"
+#include "vo/utr50.h"
+#include "script/script.h"
+#include "utf8.h"
+#include "svgwriter.h"
+#include "pdfwriter.h"
+namespace azlayout {
+
+void dumpPoint(const point_t& aPoint) {
+  fprintf(stderr, "(%f, %f) ", aPoint.mX, aPoint.mY);
+}
+
+void dumpRect(const rect_t& aRect) {
+  std::cerr << "{";
+  dumpPoint(aRect.mStart);
+  dumpPoint(aRect.mEnd);
+  std::cerr << "}" << std::endl;
+}
+inline
+void getVerticalOriginFromLineRect(const rect_t& aRect, const double aFontSize,
+                                   point_t& aOrigin) {
+  aOrigin.mX = aRect.mEnd.mX - (aFontSize / 2.);
+  aOrigin.mY = aRect.mStart.mY;
+}
+
+inline
+void getHorizontalOriginFromLineRect(const rect_t& aRect, const double aAscent,
+                                     point_t& aOrigin) {
+  aOrigin.mX = aRect.mEnd.mX;
+  aOrigin.mY = aRect.mStart.mY - aAscent;
+}
+
+inline
+void getVerticalLineRect(const rect_t& aRect, const point_t& aOffset,
+                         const double aLineTickness,
+                         rect_t& aLineRect) {
+  aLineRect.mStart.mX = aRect.mEnd.mX + aOffset.mX - aLineTickness;
+  aLineRect.mStart.mY = aRect.mStart.mY + aOffset.mY;
+  aLineRect.mEnd.mX = aRect.mEnd.mX + aOffset.mX;
+  aLineRect.mEnd.mY = aRect.mEnd.mY;
+}
+
+inline
+void getHorizontalLineRect(const rect_t& aRect,
+                           const double aAdvanceOffset,
+                           const double aLineProgressOffset,
+                           const double aLineTickness,
+                           rect_t& aLineRect) {
+  aLineRect.mStart.mX = aRect.mEnd.mX + aAdvanceOffset;
+  aLineRect.mStart.mY = aRect.mStart.mY + aLineProgressOffset;
+  aLineRect.mEnd.mX = aRect.mEnd.mX;
+  aLineRect.mEnd.mY = aRect.mStart.mY + aLineProgressOffset + aLineTickness ;
+}
+
+void fail(const char* aFormat, ...) __attribute__((noreturn, format(printf, 1, 2)));
+void fail(const char* aFormat, ...) {
+  char message[256];
+  va_list args;
+  va_start(args, aFormat);
+  vsnprintf(message, sizeof(message), aFormat, args);
+  va_end(args);
+  throw std::runtime_error(message);
+}
+
+static const char _kDummyDumpcairo[] = "";
+void dumpcairo(cairo_t* aC, int aLine, const char* aInfo = _kDummyDumpcairo) {
+  cairo_status_t cs = cairo_status(aC);
+  if (cs) {
+    fail("L%d: cairo_status:%s %s",
+         aLine, cairo_status_to_string(cs), aInfo);
+  }
+}
+#define AZ_DUMP_CAIRO(_c_,_m_) dumpcairo(_c_,__LINE__,_m_)
+static std::atomic<uint64_t> gShapeAllocations(0);
+
+bool
+parseEmphasisTag(const std::string& aTag, SelectionList& aSelection,
+                 uint32_t aEnd) {
+  // What I need here is regexp, sigh. wating for C++11.
+  static const char header[] = u8R"(＃「)";
+  static const char footer[] = u8R"(」に傍点)";
+
+  if ((sizeof(header) + sizeof(footer)) >= aTag.size()) {
+    return false;
+  }
+
+  if (0 != strncmp(aTag.c_str(), header, sizeof(header) - 1)) {
+    return false;
+  }
+
+  if (0 != strncmp((aTag.c_str() + (aTag.size() - sizeof(footer) + 1)),
+                   footer, sizeof(footer))) {
+    return false;
+  }
+
+  aSelection.push(range_t(aEnd - (aTag.size() -
+                                  (sizeof(header) + sizeof(footer) - 2)),
+                          aEnd));
+
+  return true;
+}
+namespace {
+
+// Splits the parent document into runs of text progression while it is
+// appended, one code point at a time. Adjacent runs of the same progression
+// are merged on the way.
+class RotationAnalyzer {
+  TextPropertyList& mRuns; // The last run is still open.
+  uint32_t mRotatedLength;
+  uint32_t mTrStart; // Where the Tr code points at the end start.
+  uint32_t mTrCount;
+
+  progressionProperty current() const {
+    return mRuns.mProgressions.back();
+  }
+
+  void newRun(uint32_t aStart, progressionProperty aProgression) {
+    mRuns.mRanges.back().mEnd = aStart;
+    mRuns.push(range_t(aStart, aStart), aProgression);
+  }
+
+public:
+  // @param aStart  Where the first run starts.
+  RotationAnalyzer(TextPropertyList& aRuns, uint32_t aStart)
+    : mRuns(aRuns), mRotatedLength(0), mTrStart(0), mTrCount(0) {
+    mRuns.push(range_t(aStart, aStart), TEXT_PROPERTY_VERTICAL);
+  }
+
+  // @param aOffset  Where |aCodepoint| starts in the parent document.
+  void append(uint32_t aCodepoint, uint32_t aOffset) {
+    utr50::property property = utr50::getProperty(aCodepoint);
+    switch (property) {
+    case utr50::R:
+      if (0x0a != aCodepoint &&
+          0x2026 != aCodepoint &&
+          0x2015 != aCodepoint &&
+          TEXT_PROPERTY_VERTICAL == current()) {
+        // Tr code points right before go horizontal too.
+        uint32_t pos = (mTrCount)? mTrStart : aOffset;
+        // XXX This wraps around if there are any, so that the run is never
+        //     vertical nor tatechuyoko.
+        mRotatedLength = 0 - mTrCount;
+        newRun(pos, TEXT_PROPERTY_HORIZONTAL);
+      }
+      break;
+    case utr50::Tu:
+    case utr50::U:
+      if (0x0a != aCodepoint && TEXT_PROPERTY_HORIZONTAL == current()) {
+        if (mRotatedLength < 2) {
+          // Too short to rotate. Give it back to the vertical run before.
+          mRuns.pop();
+          break;
+        }
+        if (mRotatedLength == 2) {
+          mRuns.mProgressions.back() = TEXT_PROPERTY_TATECHUYOKO;
+        }
+        newRun(aOffset, TEXT_PROPERTY_VERTICAL);
+      }
+      break;
+    case utr50::Tr:
+      break;
+    }
+    if (0x0a != aCodepoint && TEXT_PROPERTY_HORIZONTAL == current()) {
+      mRotatedLength++;
+    }
+
+    if (utr50::Tr == property) {
+      if (0 == mTrCount) {
+        mTrStart = aOffset;
+      }
+      mTrCount++;
+    }
+    else {
+      mTrCount = 0;
+    }
+  }
+
+  void finish(uint32_t aLength) {
+    mRuns.mRanges.back().mEnd = aLength;
+  }
+};
+
+} // namespace
+
+// Text is decoded this many bytes at a time, so that the decoded code points
+// (8 bytes each) never take more than a few hundred KiB.
+const uint32_t kDecodeChunk = 64 * 1024;
+
+void
+analizeDocumentRotation(const std::string& aString, TextPropertyList& aTP) {
+  RotationAnalyzer rotation(aTP, 0);
+  DecodedUTF8 decoded;
+  uint32_t chunkStart = 0;
+  while (chunkStart < aString.size()) {
+    const char* chunk = aString.c_str() + chunkStart;
+    uint32_t chunkLength = chunkEndUTF8(chunk, aString.size() - chunkStart,
+                                        kDecodeChunk);
+    decodeUTF8(chunk, chunkLength, decoded);
+    for (uint32_t i = 0; i < decoded.length(); i++) {
+      rotation.append(decoded.mCodepoints[i],
+                      chunkStart + decoded.mOffsets[i]);
+    }
+    chunkStart += chunkLength;
+  }
+  rotation.finish(aString.size());
+}
+
+void
+parseStrictAozora2(const char* aData, uint32_t aLength,
+                   std::string& aParentDocument, TextPropertyList& aTP,
+                   RubyList& aRuby, SelectionList& aEm,
+                   SourceMap& aSourceMap,
+                   std::ostream* aErrorLog) {
+  RotationAnalyzer rotation(aTP, aParentDocument.size());
+  // Markup only makes it shorter, except for ligatures.
+  aParentDocument.reserve(aParentDocument.size() + aLength);
+
+  // The markup is decoded a chunk at a time. |codepoints| and |clusters| are
+  // those of the current chunk, which starts at |chunkStart| in |aData|.
+  DecodedUTF8 decoded;
+  const uint32_t* codepoints = nullptr;
+  const uint32_t* clusters = nullptr;
+  uint32_t glyphlen = 0;
+  uint32_t chunkStart = 0;
+  uint32_t chunkEnd = 0;
+
+  // We don't own |aData|, so instead of appending some meaningless codepoint
+  // at the end of the array, pretend there is a "\n" after the last one.
+  auto nextCodepoint = [&](uint32_t aIndex) -> uint32_t {
+    if (aIndex + 1 < glyphlen) {
+      return codepoints[aIndex + 1];
+    }
+    return (chunkEnd < aLength)?
+      decodeFirstUTF8(aData + chunkEnd, aLength - chunkEnd) : 0x0a;
+  };
+
+  uint32_t notSelected(0);
+  // Where the last character and the Han run it ends (if any) start in
+  // |aParentDocument|. A ruby without '｜' goes on that run.
+  uint32_t lastStart(0);
+  uint32_t hanStart(0);
+  bool isInHan = false;
+
+  uint32_t rubyParent(0);
+  bool isInRuby = false;
+  bool isInTag = false;
+  bool isInHTMLTag = false;
+  std::string tag("");
+
+  int32_t ligIndex = - 1;
+
+  // Code points at the top of the next chunk which a ligature already took.
+  uint32_t skipped = 0;
+#ifdef DEBUG
+  uint32_t decodedLength = 0;
+#endif
+  while (chunkEnd < aLength) {
+    chunkStart = chunkEnd;
+    chunkEnd = chunkStart + chunkEndUTF8(aData + chunkStart,
+                                         aLength - chunkStart, kDecodeChunk);
+    decodeUTF8(aData + chunkStart, chunkEnd - chunkStart, decoded);
+    codepoints = decoded.mCodepoints.data();
+    clusters = decoded.mOffsets.data();
+    glyphlen = decoded.length();
+#ifdef DEBUG
+    decodedLength += glyphlen;
+#endif
+
+    uint32_t i;
+    for (i = skipped; i < glyphlen; i++) {
+      switch (codepoints[i]) {
+      case 0x0000FF5C: // '｜';
+        rubyParent = aParentDocument.size();
+        continue;
+        break;
+      case 0x0000300A: // '《'; [0xE3, 0x80, 0x8A, 0x00]
+        isInRuby = true;
+        if (!rubyParent && notSelected) {
+          // Don't go back beyond the previous ruby. If the last character
+          // isn't Han, the ruby is on it alone.
+          rubyParent = (isInHan)?
+            std::max(hanStart, uint32_t(aParentDocument.size() - notSelected)) :
+            lastStart;
+        }
+        aRuby.push(range_t(rubyParent, aParentDocument.size()));
+        rubyParent = 0;
+        notSelected = 0;
+        continue;
+        break;
+      case 0x0000300B: // '》';
+        isInRuby = false;
+        continue;
+        break;
+      case 0x0000FF3B: // '［'; [0xef, 0xbc, 0xbb, 0x00]
+        if (0x0000FF03 == nextCodepoint(i)) {
+          isInTag = true;
+          continue;
+        }
+        break;
+      case 0x0000FF3D: // '］'; [0xef, 0xbc, 0xbd, 0x00]
+        if (isInTag) {
+          isInTag = false;
+          if (parseEmphasisTag(tag, aEm, aParentDocument.size())) {
+#ifdef DEBUG
+            std::cerr << aParentDocument.c_str() + aEm.mRanges.back().mStart
+                      << "\n";
+#endif
+          }
+          else {
+            if (aErrorLog) {
+              *aErrorLog << tag << std::endl;
+            }
+            std::cerr << "Unknown Tag: " << tag << std::endl;
+          }
+
+          tag = "";
+          continue;
+        }
+        break;
+      case uint32_t('!'):  // '!'
+          // XXX we should do TATECHUYOKO instead of ligature.
+          if (uint32_t('!') == nextCodepoint(i)) {
+            ligIndex = 0;
+          }
+          else if (uint32_t('?') == nextCodepoint(i)) {
+            ligIndex = 1;
+          }
+        break;
+      case uint32_t('<'): // kPBegin[0]
+        isInHTMLTag = true;
+        continue;
+        break;
+      case uint32_t('>'): // kPBegin[0]
+        isInHTMLTag = false;
+        continue;
+        break;
+      }
+
+      uint32_t byteLen = clusters[i + 1] - clusters[i];
+      const char* ptr = aData + chunkStart + clusters[i];
+      uint32_t codepoint = codepoints[i];
+      const uint32_t sourceOffset = chunkStart + clusters[i];
+
+      if (ligIndex >= 0) {
+        static const char lig0[] = u8R"(‼)";
+        static const char lig1[] = u8R"(⁉)";
+        ptr = (ligIndex == 0)? lig0 : lig1;
+        codepoint = (ligIndex == 0)? 0x203C : 0x2049;
+        byteLen = sizeof(lig0) - 1;
+        ligIndex = -1;
+        i++;
+      }
+
+      if (isInRuby) {
+        aRuby.append(ptr, byteLen);
+      }
+      else if (isInTag) {
+        tag.append(ptr, byteLen);
+      }
+      else if (isInHTMLTag) {
+        // To do ... what?
+      }
+      else {
+        rotation.append(codepoint, aParentDocument.size());
+        aSourceMap.push(aParentDocument.size(), sourceOffset);
+        lastStart = aParentDocument.size();
+        if (script::Han == script::getCategory(codepoint)) {
+          if (!isInHan) {
+            hanStart = lastStart;
+            isInHan = true;
+          }
+        }
+        else {
+          isInHan = false;
+        }
+        aParentDocument.append(ptr, byteLen);
+        notSelected += byteLen;
+      }
+    }
+    skipped = i - glyphlen;
+  }
+#ifdef DEBUG
+  fprintf(stderr, "length:%u\n", decodedLength);
+#endif
+  rotation.finish(aParentDocument.size());
+}
+
+
+Font::Font(const char* aFontName, FT_Library aFTLib, const double aSize,
+           orient aOrient) :
+  mSize(aSize), mOrient(aOrient), mHOriginY(0) {
+
+  if (!aFontName || !(*aFontName)) {
+    aFontName = "Serif";
+  }
+
+  int fontindex = 0;
+  const char* fontpath = nullptr;
+  FcPattern* fcFont = nullptr;
+  {
+    FcPattern* pattern = FcNameParse((const FcChar8*) aFontName);
+    FcConfigSubstitute(nullptr, pattern, FcMatchPattern);
+    FcDefaultSubstitute(pattern);
+
+    FcResult fcResult;
+    if (kVertical == aOrient) {
+      FcPatternAddBool(pattern, FC_VERTICAL_LAYOUT, FcTrue);
+    }
+    fcFont = FcFontMatch(nullptr, pattern, &fcResult);
+    FcPatternDestroy(pattern);
+
+    FcChar8* ufontpath = nullptr;
+    if (!fcFont ||
+        FcResultMatch != FcPatternGetString(fcFont, FC_FILE, 0, &ufontpath)) {
+      if (fcFont) {
+        FcPatternDestroy(fcFont);
+      }
+      fail("FcFontMatch: %s", aFontName);
+    }
+    fontpath = (const char*)(ufontpath);
+
+    FcPatternGetInteger(fcFont, FC_INDEX, 0, &fontindex);
+  }
+
+  //  This seems extremely tricky, but don't mix up
+  //  the Freetype object for cairo and that for harfbuzz.
+  FT_Error fte = FT_New_Face(aFTLib, fontpath, fontindex, &mFTCAFont);
+
+  if (fte) {
+    FcPatternDestroy(fcFont);
+    fail("FT_New_Face:0x%x, %s", fte, aFontName);
+  }
+
+  fte = FT_New_Face(aFTLib, fontpath, fontindex, &mFTHBFont);
+
+  if (fte) {
+    FT_Done_Face(mFTCAFont);
+    FcPatternDestroy(fcFont);
+    fail("FT_New_Face:0x%x, %s", fte, aFontName);
+  }
+
+  FcPatternDestroy(fcFont);
+
+  mHBFont = hb_ft_font_create(mFTHBFont, nullptr);
+  mCAFont = cairo_ft_font_face_create_for_ft_face
+             (mFTCAFont, (isVertical())? FT_LOAD_VERTICAL_LAYOUT : 0);
+
+  cairo_matrix_init_scale(&mMatrix, mSize, mSize);
+  if (!isVertical()) {
+    // Rotate 90deg clockwise, and center the glyphs in the line.
+    // The metrics are hinted the same as PDF/SVG surfaces do, i.e. not at all.
+    cairo_matrix_t ctm;
+    cairo_matrix_init_identity(&ctm);
+    cairo_font_options_t* options = cairo_font_options_create();
+    cairo_font_options_set_hint_style(options, CAIRO_HINT_STYLE_NONE);
+    cairo_font_options_set_hint_metrics(options, CAIRO_HINT_METRICS_OFF);
+    cairo_scaled_font_t* scaledFont =
+      cairo_scaled_font_create(mCAFont, &mMatrix, &ctm, options);
+    cairo_font_extents_t fe;
+    cairo_scaled_font_extents(scaledFont, &fe);
+    cairo_scaled_font_destroy(scaledFont);
+    cairo_font_options_destroy(options);
+
+    double originDelta = (fe.ascent * mSize)/ (fe.ascent + fe.descent);
+    mMatrix = cairo_matrix_t({0., mSize, mSize * -1., 0.,
+                              (mSize / 2.) - originDelta, 0.});
+  }
+  if (!isVertical()) {
+    resize();
+    hb_codepoint_t codepointM(0);
+    hb_font_get_glyph (mHBFont, hb_codepoint_t('M'), 0, &codepointM);
+    hb_position_t x;
+    hb_font_get_glyph_h_origin(mHBFont, codepointM, &x, &mHOriginY);
+  }
+}
+
+void Font::resize() {
+  // I'm not too sure why we have to set Freetype's font size repeatedly,
+  // but that seems what Harfbuzz requests.
+  FT_Error fte = FT_Set_Char_Size(mFTHBFont, mSize, 0,
+                                  FT_UInt(72), FT_UInt(72));
+
+  if (fte) {
+    fail("FT_Set_Char_Size:0x%x", fte);
+  }
+}
+
+ShapingContext::ShapingContext()
+  : mBuffer(hb_buffer_create()), mCapacity(0) {
+  gShapeAllocations++;
+  hb_buffer_set_unicode_funcs(mBuffer, hb_icu_get_unicode_funcs());
+}
+
+ShapingContext::~ShapingContext() {
+  hb_buffer_destroy(mBuffer);
+}
+
+ShapingContext& ShapingContext::get() {
+  static thread_local ShapingContext context;
+  return context;
+}
+
+hb_buffer_t* ShapingContext::buffer(hb_direction_t aDirection,
+                                    hb_script_t aScript,
+                                    hb_language_t aLanguage,
+                                    uint32_t aLength) {
+  // Unlike hb_buffer_reset(), this keeps the unicode funcs and the memory.
+  hb_buffer_clear_contents(mBuffer);
+  if (aLength > mCapacity) {
+    if (!hb_buffer_pre_allocate(mBuffer, aLength)) {
+      fail("hb_buffer_pre_allocate: %u", aLength);
+    }
+    mCapacity = aLength;
+    gShapeAllocations++;
+  }
+
+  hb_segment_properties_t properties;
+  memset(&properties, 0, sizeof(properties));
+  properties.direction = aDirection;
+  properties.script = aScript;
+  properties.language = aLanguage;
+  hb_buffer_set_segment_properties(mBuffer, &properties);
+  return mBuffer;
+}
+
+uint64_t ShapingContext::allocations() {
+  return gShapeAllocations;
+}
+
+size_t StringShapeCache::KeyHash::operator()(const Key& aKey) const {
+  size_t hash = std::hash<std::string>()(aKey.mText);
+  hash ^= std::hash<const void*>()(aKey.mLanguage) + 0x9e3779b9 +
+          (hash << 6) + (hash >> 2);
+  hash ^= size_t(aKey.mScript) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  hash ^= size_t(aKey.mDirection) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  return hash;
+}
+
+const ShapedString* StringShapeCache::find(const Key& aKey) {
+  auto found = mIndex.find(aKey);
+  if (found == mIndex.end()) {
+    mMisses++;
+    return nullptr;
+  }
+  mHits++;
+  mEntries.splice(mEntries.begin(), mEntries, found->second);
+  return &found->second->second;
+}
+
+const ShapedString& StringShapeCache::insert(const Key& aKey,
+                                             ShapedString&& aString) {
+  if (mEntries.size() >= mCapacity) {
+    mIndex.erase(mEntries.back().first);
+    mEntries.pop_back();
+  }
+  mEntries.emplace_front(aKey, std::move(aString));
+  mIndex[aKey] = mEntries.begin();
+  return mEntries.front().second;
+}
+
+const ShapedString& Font::shape(const char* aString, uint32_t aLength,
+                                hb_direction_t aDirection,
+                                hb_script_t aScript, const char* aLanguage) {
+  StringShapeCache::Key key;
+  key.mDirection = aDirection;
+  key.mScript = aScript;
+  key.mLanguage = hb_language_from_string(aLanguage, -1);
+  key.mText.assign(aString, aLength);
+  const ShapedString* found = mStringCache.find(key);
+  if (found) {
+    return *found;
+  }
+
+  resize();
+  hb_buffer_t* buff = ShapingContext::get().buffer(aDirection, aScript,
+                                                   key.mLanguage, aLength);
+  hb_buffer_add_utf8(buff, aString, aLength, 0, -1);
+  hb_buffer_guess_segment_properties(buff);
+  hb_shape(mHBFont, buff, nullptr, 0);
+
+  uint32_t glyphLength(0);
+  hb_glyph_info_t* hbInfo = hb_buffer_get_glyph_infos(buff, &glyphLength);
+  hb_glyph_position_t* hbPos = hb_buffer_get_glyph_positions(buff, &glyphLength);
+  ShapedString shaped(glyphLength);
+  for (uint32_t i = 0; i < glyphLength; i++) {
+    shaped[i].mGlyph = hbInfo[i].codepoint;
+    shaped[i].mCluster = hbInfo[i].cluster;
+    shaped[i].mXAdvance = hbPos[i].x_advance;
+    shaped[i].mYAdvance = hbPos[i].y_advance;
+  }
+
+  return mStringCache.insert(key, std::move(shaped));
+}
+
+const ShapedString& Font::emphasisMark() {
+  if (mEmphasisMark.empty()) {
+    static const char mark[] = u8R"(丶)";
+    mEmphasisMark = shape(mark, sizeof(mark) - 1, HB_DIRECTION_TTB,
+                          HB_SCRIPT_KATAKANA, "ja");
+  }
+  return mEmphasisMark;
+}
+
+FT_GlyphSlot Font::loadOutline(uint32_t aGlyph) const {
+  FT_Int32 flags = FT_LOAD_NO_SCALE;
+  if (isVertical()) {
+    flags |= FT_LOAD_VERTICAL_LAYOUT;
+  }
+  if (0 != FT_Load_Glyph(mFTCAFont, aGlyph, flags) ||
+      FT_GLYPH_FORMAT_OUTLINE != mFTCAFont->glyph->format) {
+    return nullptr;
+  }
+
+  FT_GlyphSlot slot = mFTCAFont->glyph;
+  if (isVertical()) {
+    // Same as cairo-ft's _cairo_ft_scaled_glyph_vertical_layout_bearing_fix.
+    FT_Outline_Translate(&slot->outline,
+                         slot->metrics.vertBearingX -
+                           slot->metrics.horiBearingX,
+                         -slot->metrics.vertBearingY -
+                           slot->metrics.horiBearingY);
+  }
+  return slot;
+}
+
+void Font::setVector(const char* aForbidden, uint32_t aLength,
+                     std::vector<uint32_t>& aVector) {
+  const ShapedString& shaped = shape(aForbidden, aLength, HB_DIRECTION_TTB,
+                                     HB_SCRIPT_KATAKANA, "ja");
+  aVector.resize(shaped.size());
+
+  uint32_t i;
+  for (i = 0; i < shaped.size(); i++) {
+    aVector[i] = shaped[i].mGlyph;
+  }
+}
+
+bool Font::isForbiddenFirstGlyph(uint32_t aCodepoint) {
+  if (0 == mForbiddenFirstGlyphs.size()) {
+    // note that this list will be very long, in the end.
+    static const char forbidden[] = u8R"(。、」』)）)";
+    setVector(forbidden, sizeof(forbidden) - 1, mForbiddenFirstGlyphs);
+    std::sort(mForbiddenFirstGlyphs.begin(), mForbiddenFirstGlyphs.end());
+  }
+  return std::binary_search(mForbiddenFirstGlyphs.begin(),
+                            mForbiddenFirstGlyphs.end(), aCodepoint);
+}
+
+bool Font::isForbiddenLastGlyph(uint32_t aCodepoint) {
+  if (0 == mForbiddenLastGlyphs.size()) {
+    static const char forbidden[] = u8R"(「『(（)";
+    setVector(forbidden, sizeof(forbidden) - 1, mForbiddenLastGlyphs);
+    std::sort(mForbiddenLastGlyphs.begin(), mForbiddenLastGlyphs.end());
+  }
+  return std::binary_search(mForbiddenLastGlyphs.begin(),
+                            mForbiddenLastGlyphs.end(), aCodepoint);
+}
+
+Font::~Font() {
+  cairo_font_face_destroy(mCAFont);
+  hb_font_destroy(mHBFont);
+  FT_Done_Face(mFTCAFont);
+  FT_Done_Face(mFTHBFont);
+}
+
+FontCache::~FontCache() {
+  for (auto& entry : mEntries) {
+    delete entry.mFont;
+  }
+}
+
+Font* FontCache::get(const std::string& aFace, double aSize, orient aOrient) {
+  // There are only a few fonts per document, so a linear search is enough.
+  for (auto& entry : mEntries) {
+    if (entry.mSize == aSize && entry.mOrient == aOrient &&
+        entry.mFace == aFace) {
+      return entry.mFont;
+    }
+  }
+
+  Entry entry = {aFace, aSize, aOrient,
+                 new Font(aFace.c_str(), mFTLib, aSize, aOrient)};
+  mEntries.push_back(entry);
+  return entry.mFont;
+}
+
+// Lay out |aShaped|, |aStringLength| bytes of UTF-8, along |aRect| as ruby
+// (or an emphasis mark) and add it to the annotations of |aPage|, if any.
+// @return  The bytes laid out, which may be shorter than the whole if
+//          |aRatio| asks to leave some for the next line.
+uint32_t
+printAnnotation(Font* aFont, PageDisplayList* aPage,
+                const ShapedString& shaped, uint32_t stringLength,
+                const rect_t& aRect, const double aRatio,
+                glyphRunKind aKind) {
+  const double fontsize = aFont->mSize;
+
+  // Step 1. Estimate
+
+  uint32_t wholeLength = shaped.size();
+
+  uint32_t length = (aRatio > 0. && wholeLength > 1)?
+    uint32_t(wholeLength * (1.0 - aRatio)) : wholeLength;
+
+  const int32_t maxAdvance = ::floor(aRect.height() * 64. / fontsize);
+
+  int32_t totalAdvance(0);
+  // XXX Make sure we don't handle too big data (UTF-8 stream).
+  uint32_t numGlyphs;
+
+  for (numGlyphs = 0; numGlyphs < length; numGlyphs++) {
+
+    if (shaped[numGlyphs].mGlyph == 0) {
+      // XXX This is unexpected. Should we use another font,
+      //     e.g. switching between HanaMin(花園明朝) 1 and 2?
+      break;
+    }
+
+    totalAdvance += (shaped[numGlyphs].mYAdvance * -1);
+  }
+
+  if (numGlyphs == 0) {
+    return 0;
+  }
+
+  uint32_t dataLength(0);
+  if (wholeLength == numGlyphs) {
+    dataLength = stringLength;
+  }
+  else {
+    dataLength = shaped[numGlyphs].mCluster;
+  }
+
+  if (!aPage) {
+    return dataLength;
+  }
+
+  // Step 2. Lay out
+
+  point_t origin, previousOrigin;
+  getVerticalOriginFromLineRect(aRect, fontsize, origin);
+
+  double pad = 0.;
+  if (maxAdvance < totalAdvance) {
+    // centering for too long string.
+    origin.mY += ((maxAdvance - totalAdvance) * fontsize) / (64. * 2.);
+
+    if (origin.mY < 0.) {
+      // This implies ruby is to be printed somewhere out of the paper. 
+      origin.mY = 0.;
+    }
+  }
+  else {
+    // padding for too short string.
+    pad = ((maxAdvance - totalAdvance) * fontsize) / (64. * (numGlyphs * 2));
+    origin.mY += pad;
+    pad *= 2.;
+  }
+
+  previousOrigin = origin;
+
+  std::vector<cairo_glyph_t>& glyphs = aPage->annotations(aKind, aFont).mGlyphs;
+  const size_t base = glyphs.size();
+  glyphs.resize(base + numGlyphs);
+  cairo_glyph_t* glyphbuffer = glyphs.data() + base;
+
+  uint32_t i;
+  for (i = 0; i < numGlyphs; i++) {
+    glyphbuffer[i].index = shaped[i].mGlyph;
+    glyphbuffer[i].x = origin.mX;
+    glyphbuffer[i].y = origin.mY;
+
+    origin.mX += (shaped[i].mXAdvance * fontsize) / 64.;
+    origin.mY -= (shaped[i].mYAdvance * fontsize) / 64.;
+
+    origin.mY += pad;
+  }
+
+  return dataLength;
+}
+
+uint32_t
+printRuby(Font* aFont, PageDisplayList* aPage,
+          const char* aString, const rect_t& aRect, const double aRatio = 0.) {
+  const uint32_t length = ::strlen(aString);
+  // The same readings appear again and again.
+  const ShapedString& shaped = aFont->shape(aString, length,
+                                            HB_DIRECTION_TTB,
+                                            HB_SCRIPT_KATAKANA, "ja");
+  return printAnnotation(aFont, aPage, shaped, length, aRect, aRatio,
+                         GLYPH_RUN_RUBY);
+}
+
+// |aPage| is null to lay out without glyph runs, see DisplayList::mGlyphRuns.
+lineState
+printLine(Font* aFont, PageDisplayList* aPage,
+          const ShapedFragment& aFragment,
+          uint32_t& aWritten, uint32_t aDocumentOffset,
+          const rect_t& aRect,
+          point_t& aDelta,
+          AnnotationCursor& aCursor, Font* aRubyFont) {
+  const hb_glyph_info_t* hbInfo = aFragment.mInfo.data();
+  const hb_glyph_position_t* hbPos = aFragment.mPos.data();
+  // The last glyph is a dummy.
+  const uint32_t glyphLength = aFragment.mInfo.size() - 1;
+
+  const double fontsize = aFont->mSize;
+
+  const uint32_t& dataOffset = hbInfo[aWritten].cluster;
+  const char* document = aFragment.mText;
+
+  const RubyList& rubies = *aCursor.mRubies;
+  const SelectionList& ems = *aCursor.mEms;
+  uint32_t rubyIndex = aCursor.mRuby;
+  uint32_t emIndex = aCursor.mEm;
+  const range_t* ruby =
+    (rubyIndex < rubies.size())? &rubies.mRanges[rubyIndex] : nullptr;
+  const range_t* em = (emIndex < ems.size())? &ems.mRanges[emIndex] : nullptr;
+  uint32_t rubyStart = aCursor.mRubyStart;
+  uint32_t rubyDataOffset = aCursor.mRubyDataOffset;
+  auto nextRuby = [&]() {
+    rubyIndex++;
+    ruby = (rubyIndex < rubies.size())? &rubies.mRanges[rubyIndex] : nullptr;
+    rubyStart = (ruby)? ruby->mStart : 0;
+    rubyDataOffset = 0;
+  };
+  // [72 dot per inch] = [1 dot per point]
+
+
+  const int32_t maxAdvance = ::floor(aRect.height() * 64. / fontsize);
+
+  // The line ends at the next line feed at the latest, and before the
+  // first glyph that doesn't fit in |maxAdvance|.
+  const uint32_t hardBreak =
+    *std::lower_bound(aFragment.mHardBreaks.begin(),
+                      aFragment.mHardBreaks.end(), aWritten);
+  const int32_t* advances = aFragment.mAdvances.data();
+  const int32_t* found =
+    std::upper_bound(advances + aWritten, advances + hardBreak + 1,
+                     advances[aWritten] + maxAdvance);
+  const uint32_t end = (found == advances + aWritten)?
+    aWritten : (found - advances) - 1;
+
+  uint32_t numGlyphs = end - aWritten;
+  lineState state = (end == hardBreak && hardBreak < glyphLength)?
+    LINE_STATE_HARD_LINEBREAK : LINE_STATE_SOFT_LINEBREAK;
+
+  // Process Kinsoku (禁則)
+  if (LINE_STATE_SOFT_LINEBREAK == state && numGlyphs > 1) {
+    const uint8_t* flags = aFragment.mFlags.data();
+    // This line's last Glyph.
+    if (flags[end - 1] & GLYPH_FORBIDDEN_LAST) {
+      numGlyphs--;
+    }
+    // The next line's first Glyph.
+    else if (end < glyphLength && (flags[end] & GLYPH_FORBIDDEN_FIRST)) {
+      numGlyphs++;
+    }
+  }
+
+  if (numGlyphs == 0) {
+    if (aWritten == glyphLength) {
+      state = LINE_STATE_END_OF_STRING;
+    }
+    else if (state == LINE_STATE_HARD_LINEBREAK) {
+      aWritten++;
+    }
+
+    return state;
+  }
+
+  uint32_t dataLength(0);
+  if (state == LINE_STATE_HARD_LINEBREAK) {
+    dataLength = hbInfo[aWritten + numGlyphs + 1].cluster - dataOffset;
+  }
+  else {
+    dataLength = hbInfo[aWritten + numGlyphs].cluster - dataOffset;
+  }
+
+  // Step 2. Lay out
+#ifdef DEBUG
+  std::cerr << "data: " << dataLength  << " bytes" << std::endl;
+  dumpRect(aRect);
+#endif
+
+#ifdef DEBUG
+  std::cerr << "num: " << numGlyphs << std::endl;
+  std::cerr << "TotalAdvance: " << advances[end] - advances[aWritten]
+            << std::endl;
+  std::cerr << "maxAdvance: " << maxAdvance << std::endl;
+#endif
+
+  // The whole line goes to cairo at once. Font::mMatrix already rotates
+  // horizontal text.
+  GlyphRun line(GLYPH_RUN_TEXT, aFont);
+  std::vector<cairo_glyph_t>& glyphs = line.mGlyphs;
+  std::vector<cairo_text_cluster_t>& clusters = line.mClusters;
+  if (aPage) {
+    glyphs.resize(numGlyphs);
+    clusters.resize(numGlyphs);
+  }
+
+  point_t origin, previousOrigin;
+  getVerticalOriginFromLineRect(aRect, fontsize, origin);
+  previousOrigin = origin;
+
+  bool isInRuby = false;
+  rect_t rubyRect;
+  const uint32_t tmpDataOffset = dataOffset + dataLength;
+  const char* clusterStr = document + dataOffset;
+
+  uint32_t clusterTotalLength = 0;
+  uint32_t i;
+  for (i = 0; i < numGlyphs; i++) {
+    if (aPage) {
+      glyphs[i].index = hbInfo[aWritten + i].codepoint;
+      glyphs[i].x = origin.mX;
+      glyphs[i].y = origin.mY;
+    }
+
+    uint32_t clusterLength =
+      hbInfo[aWritten + i + 1].cluster - 
+      hbInfo[aWritten + i].cluster;
+
+#if DEBUG
+    std::string buff("");
+    std::cerr << "clusterTotalLength " << aWritten;
+    std::cerr << "aWritten " << aWritten;
+    std::cerr << "cluster: " <<  hbInfo[aWritten + i].cluster;
+
+    buff.append(clusterStr + clusterTotalLength,clusterLength);
+
+    std::cerr << " clusterLength: " << clusterLength << " " << buff;
+
+    buff = "";
+    buff.append(clusterStr, 12);
+
+    std::cerr << "c:" << buff;
+
+    buff = "";
+    buff.append(document + hbInfo[aWritten + i].cluster, clusterLength);
+
+    std::cerr << "r:" << buff <<"\n";
+#endif
+    if (aPage) {
+      clusters[i].num_bytes = clusterLength;
+      clusters[i].num_glyphs = 1;
+    }
+    clusterTotalLength += clusterLength;
+    // Set ruby
+    // XXX Reduce "if" statements.
+
+    // Set em
+    const uint32_t& glyphStartCluster = hbInfo[aWritten + i].cluster;
+    const uint32_t& glyphEndCluster = hbInfo[aWritten + i + 1].cluster;
+    if (ruby) {
+      if (!isInRuby) {
+        if (rubyStart - aDocumentOffset <= glyphStartCluster) {
+          rubyRect.mStart = point_t(aRect.mEnd.mX, origin.mY);
+          isInRuby = true;
+        }
+      }
+    }
+
+    point_t advance;
+    advance.mX = (hbPos[aWritten + i].x_advance * fontsize) / 64.;
+    advance.mY = -1. * (hbPos[aWritten + i].y_advance * fontsize) / 64.;
+    if (!aFont->isVertical()) {
+      advance = point_t(advance.mY, advance.mX);
+    }
+
+    if (aPage && em && (em->mStart - aDocumentOffset < tmpDataOffset)) {
+      if ((em->mStart - aDocumentOffset) <= glyphStartCluster &&
+          glyphStartCluster < (em->mEnd - aDocumentOffset)) {
+        rect_t emRect(point_t(aRect.mEnd.mX, origin.mY),
+                      aRubyFont->mSize, advance.mY);
+        printAnnotation(aRubyFont, aPage, aRubyFont->emphasisMark(),
+                        sizeof(u8R"(丶)") - 1, emRect, 0.,
+                        GLYPH_RUN_EMPHASIS);
+      }
+    }
+
+    origin += advance;
+
+    if (ruby) {
+      if (isInRuby) {
+        if (ruby->mEnd - aDocumentOffset <= glyphEndCluster) {
+          rubyRect.mEnd.mX = aRect.mEnd.mX + aRubyFont->mSize;
+          rubyRect.mEnd.mY = origin.mY;
+          isInRuby = false;
+
+          if (aPage) {
+            printRuby(aRubyFont, aPage,
+                      rubies.data(rubyIndex) + rubyDataOffset, rubyRect);
+          }
+        }
+      }
+    }
+
+    if (ruby && ruby->mEnd - aDocumentOffset <= glyphEndCluster) {
+      nextRuby();
+    }
+
+    if (em && em->mEnd - aDocumentOffset <= glyphEndCluster) {
+      emIndex++;
+      em = (emIndex < ems.size())? &ems.mRanges[emIndex] : nullptr;
+    }
+
+#ifdef DEBUG
+    // Note that codepoint is 4bytes (i.e. UCS4) while fonts support
+    // only 2-bytes i (0-65535).
+    if (aPage) {
+      fprintf(stderr, "codepoint: 0x%08lx x: %f, y: %f\n", 
+              glyphs[i].index, glyphs[i].x, glyphs[i].y);
+    }
+#endif
+  }
+
+  if (aPage) {
+    line.mText.assign(clusterStr, clusterTotalLength);
+    aPage->mRuns.push_back(std::move(line));
+  }
+  const uint32_t written = numGlyphs;
+
+  if (isInRuby) {
+    bool dev = (tmpDataOffset != ruby->mEnd - aDocumentOffset);
+    double ratio = 0.;
+    uint32_t length = ruby->mEnd - rubyStart;
+    if (dev && length) {
+      uint32_t left = ruby->mEnd - aDocumentOffset - tmpDataOffset;
+      ratio = double(left) / double(length);
+    }
+
+    // This is kinda headaching case: This ruby starts within this line
+    // and ends in the next line.
+    // What we can do here is cut it into 2 parts.
+    rubyRect.mEnd = point_t(aRect.mEnd.mX + aRubyFont->mSize, origin.mY);
+
+    // Without |aPage|, only a split ruby needs shaping, for its length.
+    uint32_t rubyDataLength = (aPage || dev)?
+      printRuby(aRubyFont, aPage, rubies.data(rubyIndex) + rubyDataOffset,
+                rubyRect, ratio) : 0;
+    if (dev) {
+      // The rest goes to the next line.
+      rubyDataOffset += rubyDataLength;
+      rubyStart = tmpDataOffset + aDocumentOffset;
+    }
+    else {
+      nextRuby();
+    }
+  }
+
+  aWritten += written;
+  if (state == LINE_STATE_HARD_LINEBREAK) {
+    aWritten++; // We haven't written line break yet.
+  }
+  aDelta = origin - previousOrigin;
+  aCursor.mRuby = rubyIndex;
+  aCursor.mRubyStart = rubyStart;
+  aCursor.mRubyDataOffset = rubyDataOffset;
+  aCursor.mEm = emIndex;
+
+  return state;
+}
+
+
+void
+insertVerticalLineBreak(const rect_t& aRect,
+                        const double aFontSize, const double aLineGap,
+                        point_t& aOffset) {
+  aOffset.mY = 0;
+  aOffset.mX -= (aLineGap + aFontSize);
+}
+
+class SVGFileNameProvider {
+  std::string mDirPath;
+  std::string mLatestPath;
+  std::string mFilesList;
+  uint32_t mIndex;
+  const char* mExtension; // "svg" or "svgz"
+public:
+  SVGFileNameProvider(const char* aDirPath, uint32_t aFirstIndex = 0,
+                      const char* aExtension = "svg") :
+    mFilesList(""), mIndex(aFirstIndex), mExtension(aExtension) {
+    if (aDirPath) {
+      char fileNameBuffer[FILENAME_MAX];
+      realpath(aDirPath, fileNameBuffer);
+      mDirPath = fileNameBuffer;
+    }
+  }
+  // |aLeaf| in the same directory as the pages.
+  std::string path(const char* aLeaf) const {
+    return mDirPath + "/" + aLeaf;
+  }
+
+  const char* get() {
+    char fileNameBuffer[sizeof("/000000.svgz") + 1];
+    int length = snprintf(fileNameBuffer, sizeof(fileNameBuffer), "/%06d.%s",
+                          mIndex, mExtension);
+    mLatestPath = mDirPath;
+    mLatestPath += fileNameBuffer;
+    mIndex++;
+
+    if (0 != mFilesList.size()) {
+      mFilesList.append(",", 1);
+    }
+
+    mFilesList.append("\"", 1);
+    mFilesList.append(fileNameBuffer, length);
+    mFilesList.append("\"", 1);
+
+    return mLatestPath.c_str();
+  }
+
+  void outputJSON()  {
+    mLatestPath = mDirPath;
+    mLatestPath += "/info.json";
+
+    std::ofstream ofs(mLatestPath);
+    ofs << "{\"fileLeafs\":[" << mFilesList << "]}";
+    ofs.close();
+  }
+
+  // Page i of the archive |aLeaf| is from |aOffsets[i]| up to
+  // |aOffsets[i + 1]|.
+  void outputArchiveJSON(const char* aLeaf,
+                         const std::vector<uint64_t>& aOffsets) {
+    mLatestPath = mDirPath;
+    mLatestPath += "/info.json";
+
+    std::ofstream ofs(mLatestPath);
+    ofs << "{\"archive\":\"/" << aLeaf << "\",\"offsets\":[";
+    for (size_t i = 0; i < aOffsets.size(); i++) {
+      ofs << ((i)? "," : "") << aOffsets[i];
+    }
+    ofs << "]}";
+    ofs.close();
+  }
+};
+
+void printParagraph(const ShapedFragment& aFragment,
+                    Font* aFont, Font* aRubyFont,
+                    DisplayList& aDisplayList, KihonHanmen& aKihonHanmen,
+                    const double aLineGap, AnnotationCursor& aCursor,
+                    point_t& aOffset, uint32_t aDocumentOffset, lineState aLineState) {
+  // The last glyph is a dummy.
+  uint32_t glyphLength = aFragment.mInfo.size() - 1;
+  uint32_t glyphWritten(0);
+
+
+  rect_t columnRect;
+  bool isLastColumn = aKihonHanmen.currentColumn(columnRect);
+
+  rect_t lineRect;
+  lineState state;
+  getVerticalLineRect(columnRect, aOffset, aFont->mSize, lineRect);
+  state = (columnRect.mStart.mX <= lineRect.mStart.mX)?
+             LINE_STATE_NEW_LINE : LINE_STATE_END_OF_COLUMN;
+
+  int _loopcount(0);
+  for (;;) {
+
+#ifdef DEBUG
+    std::cerr << "aOffset:";dumpPoint (aOffset);
+    std::cerr << "mStart:";dumpPoint (lineRect.mStart);std::cerr  << "\n";
+    std::cerr << "state: "<< state << std::endl;
+#endif
+
+    _loopcount++;
+    assert(_loopcount < 80000000);
+
+    switch(state) {
+    case LINE_STATE_TOO_SHORT_LINE:  // This implies given rect is abnormal.
+    case LINE_STATE_END_OF_STRING:
+      goto BREAKLOOP; // break switch(){} and for(){}.
+      break;
+
+    case LINE_STATE_END_OF_COLUMN:
+      if (isLastColumn) {
+        aDisplayList.mPages.push_back(PageDisplayList(
+          aCursor.checkpoint(aDocumentOffset +
+                               aFragment.mInfo[glyphWritten].cluster,
+                             aDisplayList.mGlyphs + glyphWritten)));
+      }
+      isLastColumn = aKihonHanmen.newColumn(columnRect);
+      aOffset = point_t(0, 0);
+      getVerticalLineRect(columnRect, aOffset, aFont->mSize, lineRect);
+      state = LINE_STATE_NEW_LINE;
+      break;
+
+    case LINE_STATE_SOFT_LINEBREAK:
+      if (glyphLength == glyphWritten) {
+        goto BREAKLOOP; // break switch(){} and for(){}.
+      }
+    case LINE_STATE_HARD_LINEBREAK:
+      insertVerticalLineBreak(columnRect, aFont->mSize, aLineGap, aOffset);
+      getVerticalLineRect(columnRect, aOffset, aFont->mSize, lineRect);
+      state = (columnRect.mStart.mX <= lineRect.mStart.mX)?
+                LINE_STATE_NEW_LINE : LINE_STATE_END_OF_COLUMN;
+      break;
+    case LINE_STATE_CONTINUE_LINE:
+    case LINE_STATE_NEW_LINE:
+      point_t delta(0., 0.);
+      state = printLine(aFont,
+                        (aDisplayList.mGlyphRuns)?
+                          &aDisplayList.mPages.back() : nullptr,
+                        aFragment,
+                        glyphWritten, aDocumentOffset, lineRect, delta, aCursor,
+                        aRubyFont);
+      aOffset += delta;
+#ifdef DEBUG
+      std::cerr << "Left:" << std::endl 
+                << (aFragment.mText + aFragment.mInfo[glyphWritten].cluster)
+                << std::endl;
+      std::cerr << "delta:";dumpPoint (delta);std::cerr  << "\n";
+#endif
+      break;
+    }
+  }
+
+  BREAKLOOP:
+  aDisplayList.mGlyphs += glyphLength;
+}
+
+uint32_t SourceMap::toSource(uint32_t aTextOffset) const {
+  auto found = std::upper_bound(mTextOffsets.begin(), mTextOffsets.end(),
+                                 aTextOffset);
+  if (found == mTextOffsets.begin()) {
+    return aTextOffset;
+  }
+  size_t index = (found - mTextOffsets.begin()) - 1;
+  return mSourceOffsets[index] + (aTextOffset - mTextOffsets[index]);
+}
+
+void parseDocument(const char* aData, uint32_t aLength, Document& aDocument,
+                   std::ostream* aErrorLog) {
+  aDocument = Document();
+  parseStrictAozora2(aData, aLength, aDocument.mText, aDocument.mTextProperty,
+                     aDocument.mRuby, aDocument.mEm, aDocument.mSourceMap,
+                     aErrorLog);
+
+#ifdef DEBUG
+  {
+    const TextPropertyList& tp = aDocument.mTextProperty;
+    std::string buff;
+    for (uint32_t i = 0; i < tp.size(); i++) {
+      if (tp.mProgressions[i] == azlayout::TEXT_PROPERTY_HORIZONTAL) {
+        buff = "";
+        buff.append(aDocument.mText.c_str() + tp.mRanges[i].mStart,
+                    tp.mRanges[i].length());
+        std::cerr << buff;
+      }
+    }
+  }
+#endif
+}
+
+AnnotationCursor::AnnotationCursor(const Document& aDocument)
+  : mRubies(&aDocument.mRuby),
+    mEms(&aDocument.mEm),
+    mRuby(0),
+    mRubyStart((aDocument.mRuby.size())?
+                 aDocument.mRuby.mRanges[0].mStart : 0),
+    mRubyDataOffset(0),
+    mEm(0) {
+}
+
+AnnotationCursor::AnnotationCursor(const Document& aDocument,
+                                   const Checkpoint& aCheckpoint)
+  : mRubies(&aDocument.mRuby),
+    mEms(&aDocument.mEm),
+    mRuby(aCheckpoint.mRuby),
+    mRubyStart(aCheckpoint.mRubyStart),
+    mRubyDataOffset(aCheckpoint.mRubyDataOffset),
+    mEm(aCheckpoint.mEm) {
+}
+
+Checkpoint AnnotationCursor::checkpoint(uint32_t aOffset,
+                                        uint32_t aGlyph) const {
+  Checkpoint checkpoint;
+  checkpoint.mOffset = aOffset;
+  checkpoint.mGlyph = aGlyph;
+  checkpoint.mRuby = mRuby;
+  checkpoint.mRubyStart = mRubyStart;
+  checkpoint.mRubyDataOffset = mRubyDataOffset;
+  checkpoint.mEm = mEm;
+  return checkpoint;
+}
+
+namespace {
+
+// Runs are shaped in windows cut right after a hard line break once they get
+// longer than this, so that a book with little Latin text isn't shaped all at
+// once. A paragraph which goes on for kMaxShapingWindow without one is cut
+// after a full stop instead, or failing that, before a code point which
+// doesn't combine with the one before it.
+const uint32_t kShapingWindow = 16 * 1024;
+const uint32_t kMaxShapingWindow = 4 * kShapingWindow;
+
+// '。' followed by kanji or kana, so that neither side of the cut is a
+// kinsoku character.
+bool isFullStopCut(const std::string& aText, uint32_t aOffset,
+                   uint32_t aEnd) {
+  static const char fullStop[] = u8R"(。)";
+  const uint32_t length = sizeof(fullStop) - 1;
+  if (aOffset < length || aOffset >= aEnd ||
+      0 != aText.compare(aOffset - length, length, fullStop)) {
+    return false;
+  }
+  script::category category =
+    script::getCategory(decodeFirstUTF8(aText.c_str() + aOffset,
+                                        aEnd - aOffset));
+  return script::Han == category || script::Kana == category;
+}
+
+bool isCombining(uint32_t aCodepoint) {
+  static hb_unicode_funcs_t* funcs = hb_icu_get_unicode_funcs();
+  switch (hb_unicode_general_category(funcs, aCodepoint)) {
+  case HB_UNICODE_GENERAL_CATEGORY_NON_SPACING_MARK:
+  case HB_UNICODE_GENERAL_CATEGORY_SPACING_MARK:
+  case HB_UNICODE_GENERAL_CATEGORY_ENCLOSING_MARK:
+    return true;
+  default:
+    return 0x200D == aCodepoint; // ZWJ
+  }
+}
+
+// @return  The end of the shaping window of |aRun| which starts at |aStart|.
+uint32_t windowEnd(const std::string& aText, const range_t& aRun,
+                   uint32_t aStart) {
+  if (aRun.mEnd - aStart <= kShapingWindow) {
+    return aRun.mEnd;
+  }
+  const char* text = aText.c_str();
+  const uint32_t from = aStart + kShapingWindow;
+  const uint32_t to = std::min(aRun.mEnd, aStart + kMaxShapingWindow);
+  const void* found = memchr(text + from, '\n', to - from);
+  if (found) {
+    return static_cast<const char*>(found) - text + 1;
+  }
+  if (to == aRun.mEnd) {
+    return aRun.mEnd;
+  }
+
+  for (uint32_t offset = from; offset < to; offset++) {
+    if (isFullStopCut(aText, offset, aRun.mEnd)) {
+      return offset;
+    }
+  }
+
+  uint32_t end = aStart + chunkEndUTF8(text + aStart, aRun.mEnd - aStart,
+                                       to - aStart);
+  while (end > from &&
+         isCombining(decodeFirstUTF8(text + end, aRun.mEnd - end))) {
+    end = aStart + chunkEndUTF8(text + aStart, aRun.mEnd - aStart,
+                                end - 1 - aStart);
+  }
+  return end;
+}
+
+// In-place inclusive prefix sum, 4 at a time with SSE2.
+void prefixSum(int32_t* aValues, uint32_t aLength) {
+  uint32_t i = 0;
+  int32_t carry = 0;
+#ifdef __SSE2__
+  __m128i sum = _mm_setzero_si128();
+  for (; i + 4 <= aLength; i += 4) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i*>(aValues + i));
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi32(x, sum);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(aValues + i), x);
+    sum = _mm_shuffle_epi32(x, 0xff);
+  }
+  carry = _mm_cvtsi128_si32(sum);
+#endif
+  for (; i < aLength; i++) {
+    carry += aValues[i];
+    aValues[i] = carry;
+  }
+}
+
+void shapeFragment(Font* aFont, const Document& aDocument,
+                   const range_t& aRange, ShapedFragment& aFragment) {
+  aFragment.mText = aDocument.mText.c_str() + aRange.mStart;
+  aFragment.mLength = aRange.length();
+
+  aFont->resize();
+  static const hb_language_t en = hb_language_from_string("en", -1);
+  hb_buffer_t* buff = ShapingContext::get().buffer(
+    (kVertical == aFont->mOrient)? HB_DIRECTION_TTB :HB_DIRECTION_LTR,
+    HB_SCRIPT_INVALID, en, aRange.length());
+
+  // Shape the run in place. The text around it is only for context.
+  hb_buffer_add_utf8(buff, aDocument.mText.c_str(), aDocument.mText.size(),
+                     aRange.mStart, aRange.length());
+  hb_buffer_guess_segment_properties(buff);
+  hb_shape(aFont->mHBFont, buff, nullptr, 0);
+
+  uint32_t glyphLength(0);
+  hb_glyph_info_t* hbInfo = hb_buffer_get_glyph_infos(buff, &glyphLength);
+  hb_glyph_position_t* hbPos =
+    hb_buffer_get_glyph_positions(buff, &glyphLength);
+  aFragment.mInfo.reserve(glyphLength + 1);
+  aFragment.mInfo.assign(hbInfo, hbInfo + glyphLength);
+  aFragment.mPos.reserve(glyphLength + 1);
+  aFragment.mPos.assign(hbPos, hbPos + glyphLength);
+  // Clusters are offsets in the whole document.
+  for (auto& info : aFragment.mInfo) {
+    info.cluster -= aRange.mStart;
+  }
+
+  hb_glyph_info_t end;
+  memset(&end, 0, sizeof(end));
+  end.cluster = aRange.length();
+  aFragment.mInfo.push_back(end);
+  hb_glyph_position_t none;
+  memset(&none, 0, sizeof(none));
+  aFragment.mPos.push_back(none);
+
+  // Line breaking only looks at the index below.
+  aFragment.mAdvances.resize(glyphLength + 1);
+  aFragment.mFlags.resize(glyphLength);
+  aFragment.mHardBreaks.clear();
+  int32_t* advances = aFragment.mAdvances.data();
+  advances[0] = 0;
+  const bool isVertical = aFont->isVertical();
+  for (uint32_t i = 0; i < glyphLength; i++) {
+    const hb_glyph_position_t& pos = aFragment.mPos[i];
+    int32_t advance = (isVertical)? (pos.y_advance * -1) : pos.x_advance;
+    // upper_bound() needs them sorted.
+    advances[i + 1] = std::max(advance, 0);
+
+    const uint32_t glyph = aFragment.mInfo[i].codepoint;
+    if (glyph == 0) {
+      aFragment.mHardBreaks.push_back(i);
+    }
+    aFragment.mFlags[i] =
+      ((aFont->isForbiddenFirstGlyph(glyph))? GLYPH_FORBIDDEN_FIRST : 0) |
+      ((aFont->isForbiddenLastGlyph(glyph))? GLYPH_FORBIDDEN_LAST : 0);
+  }
+  aFragment.mHardBreaks.push_back(glyphLength);
+  prefixSum(advances + 1, glyphLength);
+}
+
+} // namespace
+
+const ShapedFragment& ShapeCache::get(Font* aFont, const Document& aDocument,
+                                      const range_t& aRange) {
+  Key key(aFont, aRange.mStart, aRange.mEnd);
+  auto found = mFragments.find(key);
+  if (found != mFragments.end()) {
+    return found->second;
+  }
+
+  if (mSize >= mCapacity) {
+    shapeFragment(aFont, aDocument, aRange, mUncached);
+    return mUncached;
+  }
+
+  ShapedFragment& fragment = mFragments[key];
+  shapeFragment(aFont, aDocument, aRange, fragment);
+  mSize += fragment.mInfo.size() * sizeof(hb_glyph_info_t) +
+           fragment.mPos.size() * sizeof(hb_glyph_position_t) +
+           fragment.mAdvances.size() * sizeof(int32_t) +
+           fragment.mFlags.size() * sizeof(uint8_t) +
+           fragment.mHardBreaks.size() * sizeof(uint32_t);
+  return fragment;
+}
+
+void layoutDocument(Font* aFont, Font* aHFont, Font* aRubyFont,
+                    const Page& aPage, KihonHanmen& aKihonHanmen,
+                    const double aLineGap, const Document& aDocument,
+                    ShapeCache& aShapeCache, DisplayList& aDisplayList) {
+  point_t offset(0., 0.);
+  AnnotationCursor cursor(aDocument);
+
+  aDisplayList.mWidth = aPage.outerRect().width();
+  aDisplayList.mHeight = aPage.outerRect().height();
+  aDisplayList.mPages.clear();
+  aDisplayList.mPages.push_back(PageDisplayList());
+  aDisplayList.mGlyphs = 0;
+  aDisplayList.setFonts(aFont, aHFont, aRubyFont);
+
+  const TextPropertyList& tp = aDocument.mTextProperty;
+  for (uint32_t i = 0; i < tp.size(); i++) {
+    Font* font = (TEXT_PROPERTY_HORIZONTAL == tp.mProgressions[i])?
+                   aHFont : aFont;
+    uint32_t start = tp.mRanges[i].mStart;
+    do {
+      range_t window(start, windowEnd(aDocument.mText, tp.mRanges[i], start));
+      const ShapedFragment& fragment =
+        aShapeCache.get(font, aDocument, window);
+      printParagraph(fragment, font, aRubyFont,
+                     aDisplayList, aKihonHanmen,
+                     aLineGap, cursor,
+                     offset, window.mStart, LINE_STATE_CONTINUE_LINE);
+      start = window.mEnd;
+    } while (start < tp.mRanges[i].mEnd);
+  }
+}
+
+void layoutDocument(FontCache& aFonts, const Settings& aSettings,
+                    const Document& aDocument, ShapeCache& aShapeCache,
+                    DisplayList& aDisplayList) {
+  Font* font = aFonts.get(aSettings.mFontFace, aSettings.mFontSize);
+  Font* hfont = aFonts.get(aSettings.mFontFace, aSettings.mFontSize,
+                           kHorizontal);
+  Font* rubyFont = aFonts.get(aSettings.mRubyFontFace,
+                              aSettings.mFontSize * aSettings.mRubySize);
+
+  Page page = aSettings.page();
+  KihonHanmen kihonHanmen = aSettings.kihonHanmen(page);
+  layoutDocument(font, hfont, rubyFont, page, kihonHanmen, aSettings.mLineGap,
+                 aDocument, aShapeCache, aDisplayList);
+}
+
+namespace {
+
+// Lay out |aDocument| from the top of the page |aFrom| on, shaping one window
+// after another into |aFragment|. |aFlush| is called with |aDisplayList|
+// after every window, and returns false to stop there.
+template <typename Flush>
+void layoutFrom(Font* aFont, Font* aHFont, Font* aRubyFont,
+                KihonHanmen& aKihonHanmen, const double aLineGap,
+                const Document& aDocument, const Checkpoint& aFrom,
+                ShapedFragment& aFragment, DisplayList& aDisplayList,
+                Flush aFlush) {
+  point_t offset(0., 0.);
+  AnnotationCursor cursor(aDocument, aFrom);
+  aKihonHanmen.feed();
+  aDisplayList.mPages.clear();
+  aDisplayList.mPages.push_back(PageDisplayList(aFrom));
+  aDisplayList.mGlyphs = aFrom.mGlyph;
+  aDisplayList.setFonts(aFont, aHFont, aRubyFont);
+
+  // Skip the runs before the checkpoint.
+  const TextPropertyList& tp = aDocument.mTextProperty;
+  auto run = std::upper_bound(tp.mRanges.begin(), tp.mRanges.end(),
+                              aFrom.mOffset,
+                              [](uint32_t aOffset, const range_t& aRange) {
+                                return aOffset < aRange.mEnd;
+                              });
+  for (uint32_t i = run - tp.mRanges.begin(); i < tp.size(); i++) {
+    Font* font = (TEXT_PROPERTY_HORIZONTAL == tp.mProgressions[i])?
+                   aHFont : aFont;
+    uint32_t start = std::max(tp.mRanges[i].mStart, aFrom.mOffset);
+    do {
+      range_t window(start, windowEnd(aDocument.mText, tp.mRanges[i], start));
+      shapeFragment(font, aDocument, window, aFragment);
+      printParagraph(aFragment, font, aRubyFont,
+                     aDisplayList, aKihonHanmen,
+                     aLineGap, cursor,
+                     offset, window.mStart, LINE_STATE_CONTINUE_LINE);
+      if (!aFlush(aDisplayList)) {
+        return;
+      }
+      start = window.mEnd;
+    } while (start < tp.mRanges[i].mEnd);
+  }
+}
+
+// Whether |aCheckpoint| points into |aDocument| at all. One from a checkpoint
+// file of the same input and settings may still not, if the file is broken.
+bool isInDocument(const Checkpoint& aCheckpoint, const Document& aDocument) {
+  const uint32_t length = aDocument.mText.size();
+  const RubyList& rubies = aDocument.mRuby;
+  if (aCheckpoint.mOffset > length || aCheckpoint.mRubyStart > length ||
+      aCheckpoint.mRuby > rubies.size() ||
+      aCheckpoint.mEm > aDocument.mEm.size()) {
+    return false;
+  }
+  if (aCheckpoint.mRuby == rubies.size()) {
+    return 0 == aCheckpoint.mRubyDataOffset;
+  }
+  return aCheckpoint.mRubyDataOffset <= strlen(rubies.data(aCheckpoint.mRuby));
+}
+
+} // namespace
+
+uint32_t paginateDocument(FontCache& aFonts, const Settings& aSettings,
+                          const char* aData, uint32_t aLength,
+                          std::vector<PageStart>& aStarts,
+                          std::ostream* aErrorLog) {
+  Font* font = aFonts.get(aSettings.mFontFace, aSettings.mFontSize);
+  Font* hfont = aFonts.get(aSettings.mFontFace, aSettings.mFontSize,
+                           kHorizontal);
+  Font* rubyFont = aFonts.get(aSettings.mRubyFontFace,
+                              aSettings.mFontSize * aSettings.mRubySize);
+  Page page = aSettings.page();
+  KihonHanmen kihonHanmen = aSettings.kihonHanmen(page);
+
+  Document document;
+  parseDocument(aData, aLength, document, aErrorLog);
+  aStarts.clear();
+
+  // Throw pages away as soon as they are done.
+  auto flush = [&](DisplayList& aDisplayList, bool aAll) {
+    std::vector<PageDisplayList>& pages = aDisplayList.mPages;
+    size_t done = pages.size() - ((aAll)? 0 : 1);
+    for (size_t i = 0; i < done; i++) {
+      PageStart start;
+      start.mOffset = document.mSourceMap.toSource(pages[i].mStart.mOffset);
+      start.mCheckpoint = pages[i].mStart;
+      aStarts.push_back(start);
+    }
+    pages.erase(pages.begin(), pages.begin() + done);
+  };
+
+  ShapedFragment fragment;
+  DisplayList displayList;
+  displayList.mGlyphRuns = false;
+  layoutFrom(font, hfont, rubyFont, kihonHanmen, aSettings.mLineGap,
+             document, AnnotationCursor(document).checkpoint(0, 0),
+             fragment, displayList,
+             [&](DisplayList& aDisplayList) {
+               flush(aDisplayList, false);
+               return true;
+             });
+  flush(displayList, true);
+
+  return aStarts.size();
+}
+
+uint32_t printPages(FontCache& aFonts, const Settings& aSettings,
+                    const char* aData, uint32_t aLength,
+                    uint32_t aFirst, uint32_t aLast,
+                    const std::vector<Checkpoint>& aCheckpoints,
+                    cairo_write_func_t aWrite, void* aClosure,
+                    std::ostream* aErrorLog) {
+  Font* font = aFonts.get(aSettings.mFontFace, aSettings.mFontSize);
+  Font* hfont = aFonts.get(aSettings.mFontFace, aSettings.mFontSize,
+                           kHorizontal);
+  Font* rubyFont = aFonts.get(aSettings.mRubyFontFace,
+                              aSettings.mFontSize * aSettings.mRubySize);
+  Page page = aSettings.page();
+  KihonHanmen kihonHanmen = aSettings.kihonHanmen(page);
+
+  if (!aSettings.mSVGPath.empty() && !aSettings.mSVGArchive.empty()) {
+    // Its offsets and info.json are of the whole book.
+    fail("-pages can't update pages of -svgarchive");
+  }
+  if (aLast < aFirst) {
+    return 0;
+  }
+
+  Document document;
+  parseDocument(aData, aLength, document, aErrorLog);
+
+  ShapedFragment fragment;
+  Checkpoint from = AnnotationCursor(document).checkpoint(0, 0);
+  if (aFirst < aCheckpoints.size()) {
+    from = aCheckpoints[aFirst];
+    if (!isInDocument(from, document)) {
+      fail("The checkpoint of page %u is out of the document", aFirst + 1);
+    }
+  }
+  else if (aFirst > 0) {
+    // No checkpoint. Lay out the pages before, only to find where |aFirst|
+    // starts.
+    DisplayList skipped;
+    skipped.mGlyphRuns = false;
+    uint32_t done = 0;
+    bool found = false;
+    layoutFrom(font, hfont, rubyFont, kihonHanmen, aSettings.mLineGap,
+               document, from, fragment, skipped,
+               [&](DisplayList& aDisplayList) {
+                 std::vector<PageDisplayList>& pages = aDisplayList.mPages;
+                 if (aFirst < done + pages.size()) {
+                   from = pages[aFirst - done].mStart;
+                   found = true;
+                   return false;
+                 }
+                 done += pages.size() - 1;
+                 pages.erase(pages.begin(), pages.end() - 1);
+                 return true;
+               });
+    if (!found) {
+      return 0;
+    }
+  }
+
+  // Stop once the last page is done, i.e. the one after it has begun.
+  const uint64_t count = uint64_t(aLast - aFirst) + 1;
+  DisplayList displayList;
+  displayList.mWidth = page.outerRect().width();
+  displayList.mHeight = page.outerRect().height();
+  layoutFrom(font, hfont, rubyFont, kihonHanmen, aSettings.mLineGap,
+             document, from, fragment, displayList,
+             [&](DisplayList& aDisplayList) {
+               return aDisplayList.mPages.size() <= count;
+             });
+  if (displayList.mPages.size() > count) {
+    displayList.mPages.resize(count);
+  }
+
+  if (aSettings.mSVGPath.empty()) {
+    emitPDF(displayList, aWrite, aClosure, aSettings.mCairoPDF);
+  }
+  else {
+    emitSVG(displayList, aSettings.mSVGPath.c_str(), aSettings.mThreads,
+            aFirst, nullptr, aSettings.mSVGCompression, true);
+  }
+  return displayList.mPages.size();
+}
+
+void layoutString(Font* aFont, Font* aHFont, const Page& aPage,
+                  const char* aData, uint32_t aLength,
+                  KihonHanmen& aKihonHanmen,
+                  const double aLineGap, Font* aRubyFont,
+                  DisplayList& aDisplayList,
+                  std::ostream* aErrorLog) {
+  Document document;
+  parseDocument(aData, aLength, document, aErrorLog);
+  ShapeCache shapeCache;
+  layoutDocument(aFont, aHFont, aRubyFont, aPage, aKihonHanmen, aLineGap,
+                 document, shapeCache, aDisplayList);
+}
+
+namespace {
+
+// Both are destroyed at the end of the scope, even if AZ_DUMP_CAIRO throws.
+struct CairoPage {
+  cairo_surface_t* mSurface;
+  cairo_t* mContext;
+  CairoPage(cairo_surface_t* aSurface) :
+    mSurface(aSurface), mContext(cairo_create(aSurface)) {
+    cairo_surface_set_fallback_resolution(mSurface, 72., 72.);
+  }
+  ~CairoPage() {
+    cairo_destroy(mContext);
+    cairo_surface_destroy(mSurface);
+  }
+
+  void finish() {
+    cairo_surface_finish(mSurface);
+
+    cairo_status_t status = cairo_surface_status(mSurface);
+    if (status) {
+      fail("cairo_surface_status:%s", cairo_status_to_string(status));
+    }
+  }
+};
+
+} // namespace
+
+namespace {
+
+bool operator==(const cairo_matrix_t& aA, const cairo_matrix_t& aB) {
+  return aA.xx == aB.xx && aA.yx == aB.yx && aA.xy == aB.xy &&
+         aA.yy == aB.yy && aA.x0 == aB.x0 && aA.y0 == aB.y0;
+}
+
+// What has been given to a cairo_t, so that calls changing nothing are
+// skipped. Runs of a page mostly share a few fonts and matrices.
+class CairoState {
+  cairo_t* mCa;
+  bool mHasSource;
+  bool mHasMatrix;
+  cairo_font_face_t* mFace;
+  cairo_matrix_t mMatrix;
+public:
+  explicit CairoState(cairo_t* aCa) :
+    mCa(aCa), mHasSource(false), mHasMatrix(false), mFace(nullptr),
+    mMatrix() {}
+
+  void setBlack() {
+    if (mHasSource) {
+      return;
+    }
+    cairo_set_source_rgb(mCa, 0., 0., 0.);
+    AZ_DUMP_CAIRO(mCa, "cairo_set_source_rgb");
+    mHasSource = true;
+  }
+
+  void setFont(cairo_font_face_t* aFace, const cairo_matrix_t& aMatrix) {
+    if (mFace != aFace) {
+      cairo_set_font_face(mCa, aFace);
+      AZ_DUMP_CAIRO(mCa, "cairo_set_font_face");
+      mFace = aFace;
+    }
+    if (!mHasMatrix || !(mMatrix == aMatrix)) {
+      cairo_set_font_matrix(mCa, &aMatrix);
+      AZ_DUMP_CAIRO(mCa, "cairo_set_font_matrix");
+      mMatrix = aMatrix;
+      mHasMatrix = true;
+    }
+  }
+};
+
+} // namespace
+
+void emitPage(cairo_t* aCa, const PageDisplayList& aPage) {
+  CairoState state(aCa);
+  for (auto* runs : {&aPage.mRuns, &aPage.mAnnotations}) {
+    for (auto& run : *runs) {
+      state.setBlack();
+      state.setFont(run.mFont->mCAFont, run.mMatrix);
+
+      if (run.mClusters.empty()) {
+        cairo_show_glyphs(aCa, run.mGlyphs.data(), run.mGlyphs.size());
+        AZ_DUMP_CAIRO(aCa, "cairo_show_glyphs");
+      }
+      else {
+        cairo_show_text_glyphs(aCa, run.mText.c_str(), run.mText.size(),
+                               run.mGlyphs.data(), run.mGlyphs.size(),
+                               run.mClusters.data(), run.mClusters.size(),
+                               cairo_text_cluster_flags_t(0));
+        AZ_DUMP_CAIRO(aCa, "cairo_show_text_glyphs");
+      }
+    }
+  }
+}
+
+void emitPDF(const DisplayList& aDisplayList,
+             cairo_write_func_t aWrite, void* aClosure, bool aCairo) {
+  if (!aCairo) {
+    PDFWriter pdf(aWrite, aClosure, aDisplayList.mWidth, aDisplayList.mHeight);
+    for (auto& page : aDisplayList.mPages) {
+      pdf.addPage(page);
+    }
+    pdf.finish();
+    return;
+  }
+
+  CairoPage pdf(cairo_pdf_surface_create_for_stream(aWrite, aClosure,
+                                                    aDisplayList.mWidth,
+                                                    aDisplayList.mHeight));
+  for (auto& page : aDisplayList.mPages) {
+    emitPage(pdf.mContext, page);
+    cairo_show_page(pdf.mContext);
+  }
+  pdf.finish();
+}
+
+void emitSVG(const DisplayList& aDisplayList, const char* aSVGPath,
+             uint32_t aThreads, uint32_t aFirstPage, const char* aArchive,
+             int aCompression, bool aPartial) {
+  if (aPartial && aArchive) {
+    fail("Can't update pages of an archive");
+  }
+
+  // Name every page up front, so that numbering and info.json don't depend on
+  // which thread finishes first.
+  SVGFileNameProvider svgFile(aSVGPath, aFirstPage,
+                              (aCompression > 0)? "svgz" : "svg");
+  std::vector<std::string> paths(aDisplayList.mPages.size());
+  std::unique_ptr<SVGArchive> archive;
+  if (aArchive) {
+    archive.reset(new SVGArchive(svgFile.path(aArchive).c_str()));
+  }
+  else {
+    for (auto& path : paths) {
+      path = svgFile.get();
+    }
+  }
+
+  if (0 == aThreads) {
+    aThreads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  aThreads = std::min(aThreads, std::max(uint32_t(paths.size()), 1U));
+
+  // Pages are written by every thread, and share the glyph outlines.
+  SVGGlyphs glyphs(aDisplayList.mFonts);
+  std::atomic<uint32_t> next(0);
+  std::exception_ptr error;
+  std::mutex errorMutex;
+  auto work = [&]() {
+    try {
+      uint32_t i;
+      while ((i = next++) < paths.size()) {
+        if (archive) {
+          archive->add(i, compressSVG(formatSVGPage(aDisplayList.mPages[i],
+                                                    aDisplayList.mWidth,
+                                                    aDisplayList.mHeight,
+                                                    glyphs),
+                                      aCompression));
+        }
+        else {
+          writeSVGPage(aDisplayList.mPages[i], aDisplayList.mWidth,
+                       aDisplayList.mHeight, glyphs, paths[i].c_str(),
+                       aCompression);
+        }
+      }
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> lock(errorMutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      next = paths.size();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (uint32_t i = 1; i < aThreads; i++) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  // The pages left from earlier runs still need their glyphs.
+  glyphs.write(svgFile.path(kSVGGlyphsLeaf).c_str(), aPartial);
+  if (archive) {
+    archive->finish();
+    svgFile.outputArchiveJSON(aArchive, archive->offsets());
+  }
+  else if (!aPartial) {
+    svgFile.outputJSON();
+  }
+}
+
+namespace {
+
+// A queue between two stages of printString(). Producers wait while it is
+// full, so that only a few windows and pages are in memory at a time.
+template <typename T>
+class BoundedQueue {
+  std::mutex mMutex;
+  std::condition_variable mNotEmpty;
+  std::condition_variable mNotFull;
+  std::deque<T> mItems;
+  const size_t mCapacity;
+  bool mClosed;
+  bool mAborted;
+public:
+  explicit BoundedQueue(size_t aCapacity)
+    : mCapacity(aCapacity), mClosed(false), mAborted(false) {}
+
+  // @return false  If the consumers gave up.
+  bool push(T&& aItem) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mNotFull.wait(lock, [this] {
+      return mAborted || mItems.size() < mCapacity;
+    });
+    if (mAborted) {
+      return false;
+    }
+    mItems.push_back(std::move(aItem));
+    mNotEmpty.notify_one();
+    return true;
+  }
+
+  // @return false  If there will be no more items.
+  bool pop(T& aItem) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    mNotEmpty.wait(lock, [this] {
+      return mAborted || mClosed || !mItems.empty();
+    });
+    if (mAborted || mItems.empty()) {
+      return false;
+    }
+    aItem = std::move(mItems.front());
+    mItems.pop_front();
+    mNotFull.notify_one();
+    return true;
+  }
+
+  // No more items. Consumers still get the ones in the queue.
+  void close() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mClosed = true;
+    mNotEmpty.notify_all();
+  }
+
+  // Something went wrong. Throw away everything and wake everybody up.
+  void abort() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mAborted = true;
+    mItems.clear();
+    mNotEmpty.notify_all();
+    mNotFull.notify_all();
+  }
+};
+
+const size_t kQueuedWindows = 4;
+const size_t kQueuedPages = 8;
+
+struct ShapedWindow {
+  Font* mFont;
+  uint32_t mStart;
+  ShapedFragment mFragment;
+};
+
+// Cuts every text direction run of a document into shaping windows, which
+// are looked up in |aShapeCache| first if given.
+class WindowSource {
+  const Document& mDocument;
+  Font* mFont;
+  Font* mHFont;
+  ShapeCache* mShapeCache;
+  uint32_t mRun;
+  uint32_t mStart;
+public:
+  WindowSource(const Document& aDocument, Font* aFont, Font* aHFont,
+               ShapeCache* aShapeCache)
+    : mDocument(aDocument), mFont(aFont), mHFont(aHFont),
+      mShapeCache(aShapeCache), mRun(0),
+      mStart((aDocument.mTextProperty.size())?
+               aDocument.mTextProperty.mRanges[0].mStart : 0) {}
+
+  bool next(ShapedWindow& aWindow) {
+    const TextPropertyList& tp = mDocument.mTextProperty;
+    if (mRun >= tp.size()) {
+      return false;
+    }
+    const range_t& run = tp.mRanges[mRun];
+    range_t window(mStart, windowEnd(mDocument.mText, run, mStart));
+    aWindow.mFont = (TEXT_PROPERTY_HORIZONTAL == tp.mProgressions[mRun])?
+                      mHFont : mFont;
+    aWindow.mStart = window.mStart;
+    if (mShapeCache) {
+      aWindow.mFragment = mShapeCache->get(aWindow.mFont, mDocument, window);
+    }
+    else {
+      shapeFragment(aWindow.mFont, mDocument, window, aWindow.mFragment);
+    }
+
+    mStart = window.mEnd;
+    if (mStart >= run.mEnd && ++mRun < tp.size()) {
+      mStart = tp.mRanges[mRun].mStart;
+    }
+    return true;
+  }
+};
+
+struct QueuedPage {
+  std::string mPath; // SVG only
+  uint32_t mIndex;   // SVGArchive only
+  PageDisplayList mPage;
+};
+
+// The first error of any stage, which stops all the others.
+class PipelineError {
+  std::mutex mMutex;
+  std::exception_ptr mError;
+public:
+  void set() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mError) {
+      mError = std::current_exception();
+    }
+  }
+  void rethrow() {
+    if (mError) {
+      std::rethrow_exception(mError);
+    }
+  }
+};
+
+} // namespace
+
+namespace {
+
+// printString() but on a parsed |aDocument|, timed from |aStart|.
+uint32_t printParsed(Font* aFont, Font* aHFont, const Page& aPage,
+                     const Document& aDocument, KihonHanmen& aKihonHanmen,
+                     const double aLineGap, Font* aRubyFont,
+                     const char* aSVGPath,
+                     cairo_write_func_t aWrite, void* aClosure,
+                     Stats* aStats, uint32_t aThreads,
+                     bool aCairoPDF, const char* aSVGArchive,
+                     int aSVGCompression, ShapeCache* aShapeCache,
+                     std::chrono::steady_clock::time_point aStart) {
+  typedef std::chrono::steady_clock clock;
+
+  // Fonts may be shared with the previous jobs, so count the difference.
+  std::vector<Font*> fonts{aFont};
+  for (Font* font : {aHFont, aRubyFont}) {
+    if (std::find(fonts.begin(), fonts.end(), font) == fonts.end()) {
+      fonts.push_back(font);
+    }
+  }
+  uint64_t shapeHits(0), shapeMisses(0);
+  uint64_t shapeAllocations = ShapingContext::allocations();
+  for (Font* font : fonts) {
+    shapeHits -= font->mStringCache.mHits;
+    shapeMisses -= font->mStringCache.mMisses;
+  }
+
+  // Shaping, layout and output overlap on their own threads, connected by
+  // bounded queues. Pages go out as soon as they are laid out, and neither
+  // glyphs of the whole book nor all of its pages are ever in memory.
+  BoundedQueue<ShapedWindow> windows(kQueuedWindows);
+  BoundedQueue<QueuedPage> pages(kQueuedPages);
+  PipelineError error;
+  auto abortAll = [&]() {
+    error.set();
+    windows.abort();
+    pages.abort();
+  };
+
+  DisplayList displayList;
+  displayList.mWidth = aPage.outerRect().width();
+  displayList.mHeight = aPage.outerRect().height();
+  displayList.mPages.push_back(PageDisplayList());
+  displayList.setFonts(aFont, aHFont, aRubyFont);
+
+  // The ruby font is used by the layout thread. If it is the very same Font,
+  // shape there too instead of sharing the FreeType face between threads.
+  WindowSource source(aDocument, aFont, aHFont, aShapeCache);
+  const bool shapeOnItsOwn = (aRubyFont != aFont && aRubyFont != aHFont);
+  std::vector<std::thread> threads;
+  if (shapeOnItsOwn) {
+    threads.emplace_back([&]() {
+      try {
+        ShapedWindow window;
+        while (source.next(window) && windows.push(std::move(window))) {
+          window = ShapedWindow();
+        }
+        windows.close();
+      }
+      catch (...) {
+        abortAll();
+      }
+    });
+  }
+
+  std::unique_ptr<CairoPage> pdf;
+  std::unique_ptr<PDFWriter> pdfWriter;
+  if (!aSVGPath && aCairoPDF) {
+    pdf.reset(new CairoPage(cairo_pdf_surface_create_for_stream(
+                              aWrite, aClosure,
+                              displayList.mWidth, displayList.mHeight)));
+  }
+  else if (!aSVGPath) {
+    pdfWriter.reset(new PDFWriter(aWrite, aClosure,
+                                  displayList.mWidth, displayList.mHeight));
+  }
+  // A PDF document is written page by page, but SVG pages can be written at
+  // the same time.
+  SVGFileNameProvider svgFile(aSVGPath, 0,
+                              (aSVGCompression > 0)? "svgz" : "svg");
+  SVGGlyphs glyphs(displayList.mFonts);
+  std::unique_ptr<SVGArchive> archive;
+  if (aSVGPath && aSVGArchive) {
+    archive.reset(new SVGArchive(svgFile.path(aSVGArchive).c_str()));
+  }
+  uint32_t emitters = 1;
+  if (aSVGPath) {
+    emitters = (aThreads)?
+      aThreads : std::max(1U, std::thread::hardware_concurrency());
+  }
+  for (uint32_t i = 0; i < emitters; i++) {
+    threads.emplace_back([&]() {
+      try {
+        QueuedPage page;
+        while (pages.pop(page)) {
+          if (pdfWriter) {
+            pdfWriter->addPage(page.mPage);
+          }
+          else if (pdf) {
+            emitPage(pdf->mContext, page.mPage);
+            cairo_show_page(pdf->mContext);
+          }
+          else if (archive) {
+            archive->add(page.mIndex,
+                         compressSVG(formatSVGPage(page.mPage,
+                                                   displayList.mWidth,
+                                                   displayList.mHeight,
+                                                   glyphs),
+                                     aSVGCompression));
+          }
+          else {
+            writeSVGPage(page.mPage, displayList.mWidth, displayList.mHeight,
+                         glyphs, page.mPath.c_str(), aSVGCompression);
+          }
+        }
+      }
+      catch (...) {
+        abortAll();
+      }
+    });
+  }
+
+  // Layout runs here, and passes every page but the last, which is still
+  // being filled, to the emitters.
+  uint32_t pageCount(0);
+  auto flush = [&](bool aAll) -> bool {
+    size_t done = displayList.mPages.size() - ((aAll)? 0 : 1);
+    for (size_t i = 0; i < done; i++) {
+      QueuedPage page;
+      page.mIndex = pageCount;
+      if (aSVGPath && !archive) {
+        page.mPath = svgFile.get();
+      }
+      page.mPage = std::move(displayList.mPages[i]);
+      if (!pages.push(std::move(page))) {
+        return false;
+      }
+      pageCount++;
+    }
+    displayList.mPages.erase(displayList.mPages.begin(),
+                             displayList.mPages.begin() + done);
+    return true;
+  };
+
+  try {
+    point_t offset(0., 0.);
+    AnnotationCursor cursor(aDocument);
+    ShapedWindow window;
+    while ((shapeOnItsOwn)? windows.pop(window) : source.next(window)) {
+      printParagraph(window.mFragment, window.mFont, aRubyFont,
+                     displayList, aKihonHanmen,
+                     aLineGap, cursor,
+                     offset, window.mStart, LINE_STATE_CONTINUE_LINE);
+      window = ShapedWindow();
+      if (!flush(false)) {
+        break;
+      }
+    }
+    flush(true);
+    pages.close();
+  }
+  catch (...) {
+    abortAll();
+  }
+
+  clock::time_point laidOut = clock::now();
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  error.rethrow();
+
+  if (pdfWriter) {
+    pdfWriter->finish();
+  }
+  else if (pdf) {
+    pdf->finish();
+  }
+  else {
+    glyphs.write(svgFile.path(kSVGGlyphsLeaf).c_str());
+    if (archive) {
+      archive->finish();
+      svgFile.outputArchiveJSON(aSVGArchive, archive->offsets());
+    }
+    else {
+      svgFile.outputJSON();
+    }
+  }
+
+  if (aStats) {
+    aStats->mLayoutSeconds =
+      std::chrono::duration<double>(laidOut - aStart).count();
+    aStats->mEmitSeconds =
+      std::chrono::duration<double>(clock::now() - laidOut).count();
+    aStats->mPages = pageCount;
+    for (Font* font : fonts) {
+      shapeHits += font->mStringCache.mHits;
+      shapeMisses += font->mStringCache.mMisses;
+    }
+    aStats->mShapeHits = shapeHits;
+    aStats->mShapeMisses = shapeMisses;
+    aStats->mShapeAllocations =
+      ShapingContext::allocations() - shapeAllocations;
+  }
+  return pageCount;
+}
+
+} // namespace
+
+uint32_t printString(Font* aFont, Font* aHFont, const Page& aPage,
+                 const char* aData, uint32_t aLength,
+                 KihonHanmen& aKihonHanmen,
+                 const double aLineGap, Font* aRubyFont,
+                 const char* aSVGPath,
+                 cairo_write_func_t aWrite, void* aClosure,
+                 std::ostream* aErrorLog, Stats* aStats, uint32_t aThreads,
+                 bool aCairoPDF, const char* aSVGArchive,
+                 int aSVGCompression) {
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  Document document;
+  parseDocument(aData, aLength, document, aErrorLog);
+
+  return printParsed(aFont, aHFont, aPage, document, aKihonHanmen, aLineGap,
+                     aRubyFont, aSVGPath, aWrite, aClosure, aStats, aThreads,
+                     aCairoPDF, aSVGArchive, aSVGCompression, nullptr, start);
+}
+
+uint32_t printDocument(FontCache& aFonts, const Settings& aSettings,
+                       const Document& aDocument,
+                       cairo_write_func_t aWrite, void* aClosure,
+                       ShapeCache* aShapeCache) {
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
+  Page page = aSettings.page();
+  KihonHanmen kihonHanmen = aSettings.kihonHanmen(page);
+
+  Font* vFont = aFonts.get(aSettings.mFontFace, aSettings.mFontSize);
+  Font* hFont = aFonts.get(aSettings.mFontFace, aSettings.mFontSize,
+                           kHorizontal);
+  Font* rubyFont = aFonts.get(aSettings.mRubyFontFace,
+                              aSettings.mFontSize * aSettings.mRubySize);
+
+  return printParsed(vFont, hFont, page, aDocument, kihonHanmen,
+                     aSettings.mLineGap, rubyFont,
+                     (aSettings.mSVGPath.empty())?
+                       nullptr : aSettings.mSVGPath.c_str(),
+                     aWrite, aClosure, nullptr, aSettings.mThreads,
+                     aSettings.mCairoPDF,
+                     (aSettings.mSVGArchive.empty())?
+                       nullptr : aSettings.mSVGArchive.c_str(),
+                     aSettings.mSVGCompression, aShapeCache, start);
+}
+
+uint32_t printDocument(FontCache& aFonts, const Settings& aSettings,
+                       const char* aData, uint32_t aLength,
+                       cairo_write_func_t aWrite, void* aClosure,
+                       std::ostream* aErrorLog, Stats* aStats) {
+  Page page = aSettings.page();
+  KihonHanmen kihonHanmen = aSettings.kihonHanmen(page);
+
+  Font* vFont = aFonts.get(aSettings.mFontFace, aSettings.mFontSize);
+  Font* hFont = aFonts.get(aSettings.mFontFace, aSettings.mFontSize,
+                           kHorizontal);
+  Font* rubyFont = aFonts.get(aSettings.mRubyFontFace,
+                              aSettings.mFontSize * aSettings.mRubySize);
+
+  const char* svgpath = (aSettings.mSVGPath.empty())?
+    nullptr : aSettings.mSVGPath.c_str();
+  return printString(vFont, hFont, page, aData, aLength, kihonHanmen,
+                     aSettings.mLineGap, rubyFont, svgpath,
+                     aWrite, aClosure, aErrorLog, aStats, aSettings.mThreads,
+                     aSettings.mCairoPDF,
+                     (aSettings.mSVGArchive.empty())?
+                       nullptr : aSettings.mSVGArchive.c_str(),
+                     aSettings.mSVGCompression);
+}
+
+Settings::Settings() :
+  mFontSize(16.), mRubySize(0.5), mWidth(0.), mHeight(0.), mSize(5.),
+  mRatio(9. / 16.),            // w:h = 9:16
+  mMargin(0.), mMarginLeft(0.), mMarginRight(0.), mMarginTop(0.),
+  mMarginBottom(0.), mLineGap(0.), mColumns(1), mColumnGap(0.), mThreads(0),
+  mCairoPDF(false), mSVGPath(""), mSVGArchive(""), mSVGCompression(0),
+  mFontFace(""), mRubyFontFace("") {
+}
+
+void Settings::parse(int aArgc, const char* const aArgv[]) {
+#define ARG_STRNCMP(_V_,_L_) (0==strncasecmp(_V_,"-"#_L_,sizeof(#_L_)+1))
+#define ARG_PARSE_DOUBLE(_L_,_M_) \
+  if (ARG_STRNCMP(aArgv[i],_L_)) {\
+    _M_ = atof(aArgv[i + 1]); \
+    i++;\
+  }
+
+#define ARG_PARSE_INT(_L_,_M_) \
+  if (ARG_STRNCMP(aArgv[i],_L_)) {\
+    _M_ = atoi(aArgv[i + 1]); \
+    i++;\
+  }
+
+#define ARG_PARSE_STR(_L_,_M_) \
+  if (ARG_STRNCMP(aArgv[i],_L_)) {\
+    _M_ = aArgv[i + 1]; \
+    i++;\
+  }
+
+  int32_t i;
+  for (i = 0; i < aArgc; i++) {
+    if ((i + 1) < aArgc) {
+      ARG_PARSE_DOUBLE(fontsize, mFontSize)
+      else
+      ARG_PARSE_DOUBLE(rubysize, mRubySize)
+      else
+      ARG_PARSE_DOUBLE(height, mHeight)
+      else
+      ARG_PARSE_DOUBLE(width, mWidth)
+      else
+      ARG_PARSE_DOUBLE(size, mSize)
+      else
+      ARG_PARSE_DOUBLE(ratio, mRatio)
+      else
+      ARG_PARSE_DOUBLE(margin, mMargin)
+      else
+      ARG_PARSE_DOUBLE(marginTop, mMarginTop)
+      else
+      ARG_PARSE_DOUBLE(marginBottom, mMarginBottom)
+      else
+      ARG_PARSE_DOUBLE(marginLeft, mMarginLeft)
+      else
+      ARG_PARSE_DOUBLE(marginRight, mMarginRight)
+      else
+      ARG_PARSE_DOUBLE(columnGap, mColumnGap)
+      else
+      ARG_PARSE_INT(columns, mColumns)
+      else
+      ARG_PARSE_INT(threads, mThreads)
+      else
+      ARG_PARSE_INT(svgz, mSVGCompression)
+      else
+      ARG_PARSE_STR(svgpath, mSVGPath)
+      else
+      ARG_PARSE_STR(svgarchive, mSVGArchive)
+      else
+      ARG_PARSE_STR(fontface, mFontFace)
+      else
+      ARG_PARSE_STR(rubyfontface, mRubyFontFace)
+      else
+      if (ARG_STRNCMP(aArgv[i], pdfbackend)) {
+        // "direct" (PDFWriter) or "cairo".
+        mCairoPDF = (0 == strcasecmp(aArgv[i + 1], "cairo"));
+        i++;
+      }
+    }
+  }
+#undef ARG_PARSE_STR
+#undef ARG_PARSE_INT
+#undef ARG_PARSE_DOUBLE
+#undef ARG_STRNCMP
+}
+
+void Settings::resolve() {
+  if (mHeight == 0.) {
+    mHeight = mSize * 72.;
+  }
+
+  if (mWidth == 0.) {
+    mWidth = mHeight * mRatio;
+  }
+
+  if (mMargin != 0.) {
+    if (mMarginTop == 0.) {
+      mMarginTop = mMargin;
+    }
+    if (mMarginBottom == 0.) {
+      mMarginBottom = mMargin;
+    }
+    if (mMarginLeft == 0.) {
+      mMarginLeft = mMargin;
+    }
+    if (mMarginRight == 0.) {
+      mMarginRight = mMargin;
+    }
+  }
+
+  if (mMarginRight < (mFontSize * mRubySize)) {
+    mMarginRight = (mFontSize * mRubySize);
+  }
+
+  if (mMarginBottom < (mFontSize / 2.)) {
+    mMarginBottom = (mFontSize / 2.);
+  }
+
+  if (mLineGap == 0.) {
+    mLineGap = mFontSize;
+  }
+
+  if (mColumns > 1 && mColumnGap == 0.) {
+    mColumnGap = mLineGap;
+  }
+
+  if (mThreads < 0) {
+    mThreads = 0;
+  }
+
+  if (mSVGCompression < 0 || mSVGCompression > 9) {
+    fail("-svgz %d: The level must be 0 (none) to 9", mSVGCompression);
+  }
+
+  if (mFontFace.empty()) {
+    mFontFace = "IPAexMincho";
+  }
+
+  if (mRubyFontFace.empty()) {
+    mRubyFontFace = mFontFace;
+  }
+}
+
+Page Settings::page() const {
+  return Page(mWidth, mHeight,
+              mMarginLeft, mMarginTop, mMarginRight, mMarginBottom);
+}
+
+KihonHanmen Settings::kihonHanmen(const Page& aPage) const {
+  return KihonHanmen(aPage.innerRect(), mColumnGap, mColumns);
+}
+} // azlayout
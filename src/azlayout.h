@@ -0,0 +1,802 @@
+/* 
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _AZLAYOUT_
+#define _AZLAYOUT_
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <tuple>
+#include <iosfwd>
+
+#include <cairo.h>
+#include <harfbuzz/hb.h>
+
+namespace azlayout {
+
+struct point_t {
+  point_t () {
+  }
+  point_t (double aX, double aY): mX(aX), mY(aY) {}
+  point_t (const point_t& aPoint): mX(aPoint.mX), mY(aPoint.mY) {}
+
+  point_t operator+ (const point_t& aPoint) const {
+    return point_t(mX + aPoint.mX, mY + aPoint.mY);
+  }
+
+  point_t operator- (const point_t& aPoint) const {
+    return point_t(mX - aPoint.mX, mY - aPoint.mY);
+  }
+
+  point_t operator+= (const point_t& aPoint) {
+    mX += aPoint.mX;
+    mY += aPoint.mY;
+    return (*this);
+  }
+
+  point_t operator-= (const point_t& aPoint) {
+    mX -= aPoint.mX;
+    mY -= aPoint.mY;
+    return (*this);
+  }
+
+  bool operator== (const point_t& aPoint) const {
+    return (mX == aPoint.mX) && (mY == aPoint.mY);
+  }
+  double mX, mY;
+};
+
+struct rect_t {
+  rect_t () {}
+  rect_t (const point_t& aStart, const point_t& aEnd):
+    mStart(aStart), mEnd(aEnd) {}
+  rect_t (double aSX, double aSY, double aEX, double aEY):
+    mStart(aSX, aSY), mEnd(aEX, aEY){}
+  rect_t (const point_t& aStart, double aWidth, double aHeight):
+    mStart(aStart),
+    mEnd(point_t(aStart.mX + aWidth, aStart.mY + aHeight)) {}
+  rect_t (const rect_t& aRect):
+    mStart(aRect.mStart), mEnd(aRect.mEnd) {}
+  double width() const {
+    return mEnd.mX - mStart.mX;
+  }
+  double height() const {
+    return mEnd.mY - mStart.mY;
+  }
+
+  bool isValid(const double aMinWidth = 0.,
+               const double aMinHeight = 0.) const {
+    return (aMinWidth < width()) && (aMinHeight < height());
+  }
+
+  bool contains(const point_t& aPoint) const {
+    return (mStart.mX <= aPoint.mX) && 
+           (aPoint.mX <= mEnd.mX) &&
+           (mStart.mY <= aPoint.mY) &&
+           (aPoint.mY <= mEnd.mY);
+  }
+
+  bool contains(const rect_t& aRect) const {
+    return (mStart.mX <= aRect.mStart.mX) && 
+           (mStart.mX <= aRect.mStart.mY) &&
+           (aRect.mEnd.mX <= mEnd.mX) &&
+           (aRect.mEnd.mY <= mEnd.mY);
+  }
+
+  point_t mStart, mEnd;
+};
+
+enum orient {
+  kHorizontal,
+  kVertical
+};
+
+// See <http://www.w3.org/TR/2011/WD-jlreq-20111129/#elements_of_kihonhanmen>
+// XXX Why is it difficult to translate Kihon-hanmen
+//     ("基本版面", lit. "basic-print-face") for them? However,
+//     that's out of this application's scope.
+
+class KihonHanmen {
+protected:
+  rect_t mRect;  
+  double mColumnGap;
+  orient mOrient;
+  std::vector<rect_t> mColumns;
+
+  uint32_t mIndex;
+public:
+  KihonHanmen (const rect_t& aRect, double aColumnGap = 0.,
+               uint32_t aColumnCount = 1, orient aOrient = kVertical) :
+    mRect(aRect), mColumnGap(aColumnGap), mOrient(aOrient), mIndex(0) {
+
+    mColumns.resize(aColumnCount);
+
+    double totalColumnProgress = (aOrient == kVertical)?
+      aRect.height(): aRect.width();
+    double columnSize = (aOrient == kVertical)?
+      aRect.width() : aRect.height();
+
+    double totalColumnGap = aColumnGap * (aColumnCount - 1);
+    double columnProgress = (totalColumnProgress - totalColumnGap) /
+                              aColumnCount;
+
+    // XXX Here ensure |columnProgress| is not zero/negative;
+
+    point_t start, end, delta;
+    if (aOrient == kVertical) {
+      start = aRect.mStart;
+      end = start + point_t(columnSize, columnProgress);
+      delta = point_t(0., columnProgress + aColumnGap); 
+    }
+    else {
+      start = aRect.mStart;
+      end = start + point_t(columnProgress, columnSize);
+      delta = point_t(columnProgress + aColumnGap, 0.);
+    }
+
+    for (uint32_t i = 0; i < aColumnCount; i++) {
+      mColumns[i] = rect_t(start, end);
+      start += delta;
+      end += delta;
+    }
+  }
+
+  bool currentColumn(rect_t& aFace) const {
+    aFace = mColumns[mIndex];
+    return isLastColumn();
+  }
+
+  bool isLastColumn() const {
+    return mColumns.size() - 1 == mIndex;
+  }
+
+  bool newColumn(rect_t& aFace) {
+    if (isLastColumn()) {
+      mIndex = 0;
+    }
+    else {
+      mIndex++;
+    }
+    return currentColumn(aFace);
+  }
+
+  void feed() {
+    mIndex = 0;
+  }
+};
+
+class Page {
+  rect_t mOuterRect;
+  rect_t mInnerRect;
+public:
+  double mMarginTop;
+  double mMarginBottom;
+  double mMarginLeft;
+  double mMarginRight;
+  const rect_t& innerRect() const {
+    return mInnerRect;
+  }
+  const rect_t& outerRect() const {
+    return mOuterRect;
+  }
+
+  Page (double aWidth, double aHeight,
+        double aMarginLeft = 0., double aMarginTop = 0.,
+        double aMarginRight = 0., double aMarginBottom = 0.):
+    mOuterRect(0., 0., aWidth, aHeight),
+    mMarginTop(aMarginTop), mMarginBottom(aMarginBottom),
+    mMarginLeft(aMarginLeft), mMarginRight(aMarginRight) {
+#ifdef DEBUG
+    fprintf(stderr, "Margin: %f %f %f %f\n", mMarginTop, mMarginBottom,
+                                             mMarginLeft, mMarginRight);
+#endif
+    resize();
+  }
+
+  void resize() {
+    mInnerRect.mStart.mX = mOuterRect.mStart.mX + mMarginLeft;
+    mInnerRect.mStart.mY = mOuterRect.mStart.mY + mMarginTop;
+    mInnerRect.mEnd.mX = mOuterRect.mEnd.mX - mMarginRight;
+    mInnerRect.mEnd.mY = mOuterRect.mEnd.mY - mMarginBottom;
+  }
+};
+enum lineState {
+  LINE_STATE_CONTINUE_LINE   = 0,// Start with previous line.
+  LINE_STATE_NEW_LINE        = 1,// We don't know anything. Just a initial state.
+  LINE_STATE_SOFT_LINEBREAK,     // Linebreak because of too long to render.
+  LINE_STATE_HARD_LINEBREAK,     // Linebreak because of '\n', '\r' "<br>" etc.
+  LINE_STATE_END_OF_COLUMN,      // No blank area for the next linebreak.
+  LINE_STATE_END_OF_STRING,      // No data to write exists any more.
+  LINE_STATE_TOO_SHORT_LINE
+};
+
+struct range_t {
+                    // []: selected, s: mStart = 3, e: mEnd = 7
+                    // 0 1 2 3 4 5 6 7 8 9
+                    // * * *[s * * *]e * * 
+  uint32_t mStart;  // pointer to the first byte of selected data
+  uint32_t mEnd;    // pointer to the first byte of non-selected data
+  range_t () {}
+  range_t (uint32_t aStart, uint32_t aEnd): mStart(aStart), mEnd(aEnd) {}
+  uint32_t length() const {
+    return mEnd - mStart;
+  }
+};
+
+// Annotations of a document, in the order of their ranges. Every field is
+// kept in its own array so that layouts scan them from the beginning to the
+// end without chasing pointers, and they go away with their owner.
+struct SelectionList {
+  std::vector<range_t> mRanges;
+  uint32_t size() const {
+    return mRanges.size();
+  }
+  void push(const range_t& aRange) {
+    mRanges.push_back(aRange);
+  }
+};
+
+// All the ruby text is in |mPool|, each one terminated with a NUL, and
+// |mDataOffsets| tells where.
+struct RubyList : public SelectionList {
+  std::vector<uint32_t> mDataOffsets;
+  std::string mPool;
+  void push(const range_t& aRange) {
+    if (!mDataOffsets.empty()) {
+      mPool += '\0';
+    }
+    SelectionList::push(aRange);
+    mDataOffsets.push_back(mPool.size());
+  }
+  // Ruby text of the last one.
+  void append(const char* aData, uint32_t aLength) {
+    mPool.append(aData, aLength);
+  }
+  const char* data(uint32_t aIndex) const {
+    return mPool.c_str() + mDataOffsets[aIndex];
+  }
+};
+
+
+enum progressionProperty {
+  TEXT_PROPERTY_DEFAULT = 0, // Too little infomation to decide.
+  TEXT_PROPERTY_VERTICAL,    // No rotation.
+  TEXT_PROPERTY_HORIZONTAL,  // Rotate 90deg clockwise.
+  TEXT_PROPERTY_TATECHUYOKO // kainda ligature, 2 halfwidth makes 1 fullwidth.
+};
+
+enum connectionProperty {
+  TEXT_PROPERTY_INLINE,    // Reuse the previous line.
+  TEXT_PROPERTY_LINEBREAK, // Reuse the page, but start at a new line.
+  TEXT_PROPERTY_PAGEBREAK  // Start with a brand new page.
+};
+
+// Text direction runs. The last one may be open, i.e. its mEnd is not
+// decided yet.
+struct TextPropertyList : public SelectionList {
+  std::vector<progressionProperty> mProgressions;
+  void push(const range_t& aRange, progressionProperty aProgression) {
+    SelectionList::push(aRange);
+    mProgressions.push_back(aProgression);
+  }
+  void pop() {
+    mRanges.pop_back();
+    mProgressions.pop_back();
+  }
+};
+
+// A glyph of a short string, such as ruby, shaped by a Font.
+struct ShapedGlyph {
+  uint32_t mGlyph;
+  uint32_t mCluster;
+  hb_position_t mXAdvance;
+  hb_position_t mYAdvance;
+};
+typedef std::vector<ShapedGlyph> ShapedString;
+
+// Short strings shaped by one Font (so at one size), keyed by direction,
+// script, language and UTF-8 bytes. The least recently used ones are thrown
+// away first. Ruby texts repeat a lot, and so does the emphasis mark.
+class StringShapeCache {
+public:
+  struct Key {
+    hb_direction_t mDirection;
+    hb_script_t mScript;
+    hb_language_t mLanguage;
+    std::string mText;
+    bool operator==(const Key& aOther) const {
+      return mDirection == aOther.mDirection && mScript == aOther.mScript &&
+             mLanguage == aOther.mLanguage && mText == aOther.mText;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& aKey) const;
+  };
+
+private:
+  typedef std::list<std::pair<Key, ShapedString>> Entries;
+  Entries mEntries; // The most recently used first.
+  std::unordered_map<Key, Entries::iterator, KeyHash> mIndex;
+  size_t mCapacity;
+
+public:
+  uint64_t mHits;
+  uint64_t mMisses;
+
+  explicit StringShapeCache(size_t aCapacity = 4096)
+    : mCapacity(aCapacity), mHits(0), mMisses(0) {}
+
+  // @return  nullptr if not cached yet.
+  const ShapedString* find(const Key& aKey);
+  const ShapedString& insert(const Key& aKey, ShapedString&& aString);
+};
+
+// A harfbuzz buffer per thread, cleared and reused instead of created and
+// destroyed for every string we shape. Once it has grown large enough for the
+// longest window, shaping allocates nothing; allocations() counts buffers
+// created or grown by all threads so far.
+class ShapingContext {
+  hb_buffer_t* mBuffer;
+  uint32_t mCapacity;
+
+public:
+  ShapingContext();
+  ~ShapingContext();
+
+  ShapingContext(const ShapingContext&) = delete;
+  ShapingContext& operator= (const ShapingContext&) = delete;
+
+  // The calling thread's own context.
+  static ShapingContext& get();
+
+  // @return  The empty buffer with the segment properties set, which can
+  //          hold |aLength| characters. Valid until the next call on the
+  //          same thread.
+  hb_buffer_t* buffer(hb_direction_t aDirection, hb_script_t aScript,
+                      hb_language_t aLanguage, uint32_t aLength);
+
+  static uint64_t allocations();
+};
+
+// A font face opened twice, once for cairo and once for harfbuzz, at a fixed
+// size and orientation. Keep instances around to avoid paying fontconfig and
+// FT_New_Face for every document. The constructor throws std::runtime_error
+// if the font can't be opened.
+class Font {
+public:
+  FT_Face mFTCAFont;
+  FT_Face mFTHBFont;
+  hb_font_t* mHBFont;
+  cairo_font_face_t* mCAFont;
+  double mSize;
+  orient mOrient;
+  hb_position_t mHOriginY;
+  // The font matrix to draw with, which also rotates horizontal fonts to fit
+  // in vertical lines.
+  cairo_matrix_t mMatrix;
+  Font(const char* aFontName, FT_Library aFTLib, const double aSize,
+       orient aOrient = kVertical);
+  ~Font();
+
+  Font(const Font&) = delete;
+  Font& operator= (const Font&) = delete;
+
+  void resize();
+
+  std::vector<uint32_t> mForbiddenFirstGlyphs;
+  std::vector<uint32_t> mForbiddenLastGlyphs;
+
+  StringShapeCache mStringCache;
+
+  // Shape a short string such as ruby through |mStringCache|. The result is
+  // valid until the next call.
+  const ShapedString& shape(const char* aString, uint32_t aLength,
+                            hb_direction_t aDirection, hb_script_t aScript,
+                            const char* aLanguage);
+
+  void setVector(const char* aForbidden, uint32_t aLength,
+                 std::vector<uint32_t>& aVector);
+
+  bool isForbiddenFirstGlyph(uint32_t aCodepoint);
+  bool isForbiddenLastGlyph(uint32_t aCodepoint);
+
+  // The emphasis mark (丶) shaped once and kept.
+  ShapedString mEmphasisMark;
+  const ShapedString& emphasisMark();
+
+  // Load the outline of |aGlyph| as cairo-ft draws it: in font units,
+  // unhinted, and for vertical fonts moved to the vertical origin. The glyph
+  // space of |mMatrix| is 1/units_per_EM of this, upside down. Callers must
+  // not load glyphs of the same Font on several threads at a time.
+  // @return  The glyph slot, valid until the next call, or nullptr for
+  //          glyphs without an outline.
+  FT_GlyphSlot loadOutline(uint32_t aGlyph) const;
+
+  bool isVertical () const {
+    return kVertical == mOrient;
+  }
+};
+
+enum glyphRunKind {
+  GLYPH_RUN_TEXT,
+  GLYPH_RUN_RUBY,
+  GLYPH_RUN_EMPHASIS // 傍点
+};
+
+// Glyphs positioned by the layout pass, to be drawn with one font and one
+// font matrix.
+struct GlyphRun {
+  GlyphRun(glyphRunKind aKind, Font* aFont) :
+    mKind(aKind), mFont(aFont), mMatrix(aFont->mMatrix) {}
+  glyphRunKind mKind;
+  Font* mFont;
+  cairo_matrix_t mMatrix;
+  std::vector<cairo_glyph_t> mGlyphs;
+  // The UTF-8 text and clusters behind GLYPH_RUN_TEXT, so that PDF viewers
+  // can search and copy it. Empty for the others.
+  std::string mText;
+  std::vector<cairo_text_cluster_t> mClusters;
+};
+
+// What a layout needs to go on from the top of a page: where the page starts
+// in Document::mText, how many glyphs the pages before it have, and the
+// AnnotationCursor there. A page always starts at the first column with no
+// offset, so that is all.
+struct Checkpoint {
+  uint32_t mOffset;
+  uint32_t mGlyph;
+  uint32_t mRuby;
+  uint32_t mRubyStart;
+  uint32_t mRubyDataOffset;
+  uint32_t mEm;
+};
+
+// Rubies and emphasis marks of a page are collected into |mAnnotations|, a
+// run for each kind and font, instead of being drawn one by one between lines.
+struct PageDisplayList {
+  PageDisplayList() : mStart() {}
+  explicit PageDisplayList(const Checkpoint& aStart) : mStart(aStart) {}
+  std::vector<GlyphRun> mRuns;
+  std::vector<GlyphRun> mAnnotations;
+  Checkpoint mStart;
+
+  GlyphRun& annotations(glyphRunKind aKind, Font* aFont) {
+    for (auto& run : mAnnotations) {
+      if (run.mKind == aKind && run.mFont == aFont) {
+        return run;
+      }
+    }
+    mAnnotations.push_back(GlyphRun(aKind, aFont));
+    return mAnnotations.back();
+  }
+};
+
+// What the layout pass outputs and the emitters draw. Runs point to the fonts
+// they were laid out with, which must outlive the list.
+struct DisplayList {
+  DisplayList() : mWidth(0.), mHeight(0.), mGlyphs(0), mGlyphRuns(true) {}
+  double mWidth;
+  double mHeight;
+  std::vector<PageDisplayList> mPages;
+  uint32_t mGlyphs; // Laid out so far.
+  // False to only find where pages start, e.g. for "-dryrun". Pages get no
+  // glyph runs then, and rubies are shaped only to split them between lines.
+  bool mGlyphRuns;
+  // The vertical, horizontal and ruby fonts, in this order whatever the text
+  // is, so that SVG glyph ids are the same in every run with the same
+  // settings. Set before layout starts.
+  std::vector<Font*> mFonts;
+
+  void setFonts(Font* aFont, Font* aHFont, Font* aRubyFont) {
+    mFonts = {aFont, aHFont, aRubyFont};
+  }
+};
+
+// Wall clock time of each stage of printString(). Output overlaps layout, so
+// |mEmitSeconds| is only what is left after the last page is laid out.
+// |mShapeHits| and |mShapeMisses| count lookups of the short strings
+// (rubies, emphasis marks and kinsoku characters) in StringShapeCache.
+// |mShapeAllocations| is how many times ShapingContext had to allocate.
+struct Stats {
+  double mLayoutSeconds;
+  double mEmitSeconds;
+  uint32_t mPages;
+  uint64_t mShapeHits;
+  uint64_t mShapeMisses;
+  uint64_t mShapeAllocations;
+};
+
+// Fonts keyed by (face, size, orientation), opened on the first request and
+// kept until the cache goes away.
+class FontCache {
+  struct Entry {
+    std::string mFace;
+    double mSize;
+    orient mOrient;
+    Font* mFont;
+  };
+  FT_Library mFTLib;
+  std::vector<Entry> mEntries;
+public:
+  explicit FontCache(FT_Library aFTLib) : mFTLib(aFTLib) {}
+  ~FontCache();
+
+  FontCache(const FontCache&) = delete;
+  FontCache& operator= (const FontCache&) = delete;
+
+  Font* get(const std::string& aFace, double aSize, orient aOrient = kVertical);
+};
+
+// The same knobs as the command line options, e.g. "-size 4.0" sets mSize.
+// Call resolve() once all of them are set to fill in the derived defaults.
+// It throws std::runtime_error on values out of range, e.g. "-svgz 12".
+struct Settings {
+  double mFontSize;
+  double mRubySize;
+  double mWidth;
+  double mHeight;
+  double mSize;
+  double mRatio;
+  double mMargin;
+  double mMarginLeft;
+  double mMarginRight;
+  double mMarginTop;
+  double mMarginBottom;
+  double mLineGap;
+  int    mColumns;
+  double mColumnGap;
+  int    mThreads;   // for emitSVG(), 0 for as many as the cores.
+  bool   mCairoPDF;  // "-pdfbackend cairo" instead of PDFWriter.
+  std::string mSVGPath;
+  std::string mSVGArchive; // The file in |mSVGPath| to pack pages into.
+  int    mSVGCompression;  // "-svgz", zlib's level 1 to 9, 0 for plain SVG.
+  std::string mFontFace;
+  std::string mRubyFontFace;
+
+  Settings();
+
+  // Unknown options are ignored, so that callers can have their own.
+  void parse(int aArgc, const char* const aArgv[]);
+  void resolve();
+
+  Page page() const;
+  KihonHanmen kihonHanmen(const Page& aPage) const;
+};
+
+// Where the plain text of a document comes from in its markup. Only the
+// points after which the two drift apart further are kept, i.e. one for
+// every ruby, tag or ligature.
+struct SourceMap {
+  std::vector<uint32_t> mTextOffsets;
+  std::vector<uint32_t> mSourceOffsets;
+  void push(uint32_t aTextOffset, uint32_t aSourceOffset) {
+    if (mTextOffsets.empty() ||
+        aSourceOffset - aTextOffset !=
+        mSourceOffsets.back() - mTextOffsets.back()) {
+      mTextOffsets.push_back(aTextOffset);
+      mSourceOffsets.push_back(aSourceOffset);
+    }
+  }
+  uint32_t toSource(uint32_t aTextOffset) const;
+};
+
+// Split Aozora Bunko markup |aData| into plain text |aParentDocument| and
+// annotations, which are appended to |aTP|, |aRuby| and |aEm|. Text direction
+// runs are split while the text is appended, so no two adjacent runs have
+// the same direction. Unknown tags are reported to |aErrorLog| if any.
+void
+parseStrictAozora2(const char* aData, uint32_t aLength,
+                   std::string& aParentDocument, TextPropertyList& aTP,
+                   RubyList& aRuby, SelectionList& aEm,
+                   SourceMap& aSourceMap,
+                   std::ostream* aErrorLog = nullptr);
+
+// Split plain text |aString| into text direction runs as above.
+void
+analizeDocumentRotation(const std::string& aString, TextPropertyList& aTP);
+
+// Plain text and annotations of a parsed book. Layouts only read it, so one
+// Document can be laid out to several page geometries.
+struct Document {
+  std::string mText;
+  TextPropertyList mTextProperty; // Adjacent runs of a direction are merged.
+  RubyList mRuby;
+  SelectionList mEm;
+  SourceMap mSourceMap;
+};
+
+// Where a layout is in the annotations of a Document. A ruby split over two
+// lines goes on from (mRubyStart, mRubyDataOffset) on the next line.
+struct AnnotationCursor {
+  explicit AnnotationCursor(const Document& aDocument);
+  AnnotationCursor(const Document& aDocument, const Checkpoint& aCheckpoint);
+  Checkpoint checkpoint(uint32_t aOffset, uint32_t aGlyph) const;
+  const RubyList* mRubies;
+  const SelectionList* mEms;
+  uint32_t mRuby; // index
+  uint32_t mRubyStart;
+  uint32_t mRubyDataOffset;
+  uint32_t mEm;   // index
+};
+
+enum glyphFlag {
+  GLYPH_FORBIDDEN_FIRST = 0x1, // 行頭禁則
+  GLYPH_FORBIDDEN_LAST  = 0x2  // 行末禁則
+};
+
+// A run of a Document shaped by HarfBuzz. |mText| points into the document
+// instead of copying it. |mInfo| and |mPos| end with a dummy glyph whose
+// cluster is |mLength|, so that every glyph knows where it ends.
+//
+// For line breaking, |mAdvances[i]| is the sum of the advances of the glyphs
+// before the i-th along the line, |mFlags| has glyphFlag bits of each glyph,
+// and |mHardBreaks| lists the glyphs of line feeds, then the dummy glyph.
+struct ShapedFragment {
+  const char* mText;
+  uint32_t mLength;
+  std::vector<hb_glyph_info_t> mInfo;
+  std::vector<hb_glyph_position_t> mPos;
+  std::vector<int32_t> mAdvances;
+  std::vector<uint8_t> mFlags;
+  std::vector<uint32_t> mHardBreaks;
+};
+
+// Shaped runs of one Document, keyed by font and range. Line breaking
+// depends on the page geometry but shaping does not, so layouts to several
+// geometries with the same font size shape every run only once.
+//
+// Runs are kept until they take |aCapacity| bytes, and the ones after that
+// are shaped again every time. Every layout walks the book from the start, so
+// throwing away older runs would only make room for ones that are thrown away
+// before the next layout gets to them.
+class ShapeCache {
+  typedef std::tuple<Font*, uint32_t, uint32_t> Key;
+  std::map<Key, ShapedFragment> mFragments;
+  ShapedFragment mUncached;
+  size_t mCapacity;
+  size_t mSize;
+public:
+  explicit ShapeCache(size_t aCapacity = SIZE_MAX)
+    : mCapacity(aCapacity), mSize(0) {}
+
+  // The result is valid until the next call if it was not kept.
+  const ShapedFragment& get(Font* aFont, const Document& aDocument,
+                            const range_t& aRange);
+};
+
+void parseDocument(const char* aData, uint32_t aLength, Document& aDocument,
+                   std::ostream* aErrorLog = nullptr);
+
+// Lay out a parsed |aDocument| into pages of |aDisplayList|.
+void layoutDocument(Font* aFont, Font* aHFont, Font* aRubyFont,
+                    const Page& aPage, KihonHanmen& aKihonHanmen,
+                    const double aLineGap, const Document& aDocument,
+                    ShapeCache& aShapeCache, DisplayList& aDisplayList);
+void layoutDocument(FontCache& aFonts, const Settings& aSettings,
+                    const Document& aDocument, ShapeCache& aShapeCache,
+                    DisplayList& aDisplayList);
+
+// Parse and lay out |aData| (Aozora Bunko markup in UTF-8) into pages of
+// |aDisplayList|, without touching cairo surfaces.
+void layoutString(Font* aFont, Font* aHFont, const Page& aPage,
+                  const char* aData, uint32_t aLength,
+                  KihonHanmen& aKihonHanmen,
+                  const double aLineGap, Font* aRubyFont,
+                  DisplayList& aDisplayList,
+                  std::ostream* aErrorLog = nullptr);
+
+// Where a page starts: a byte offset into the markup given to
+// paginateDocument() and the index of its first glyph.
+struct PageStart {
+  uint32_t mOffset;
+  Checkpoint mCheckpoint;
+};
+
+// Lay out |aData| only to see where pages break, without keeping the pages,
+// building their glyph runs or touching cairo. @return  The number of pages.
+uint32_t paginateDocument(FontCache& aFonts, const Settings& aSettings,
+                          const char* aData, uint32_t aLength,
+                          std::vector<PageStart>& aStarts,
+                          std::ostream* aErrorLog = nullptr);
+
+// Draw one page of a display list with |aCa|.
+void emitPage(cairo_t* aCa, const PageDisplayList& aPage);
+
+// Write |aDisplayList| as a PDF document through |aWrite|, with PDFWriter or
+// with cairo's PDF surface if |aCairo|.
+void emitPDF(const DisplayList& aDisplayList,
+             cairo_write_func_t aWrite, void* aClosure, bool aCairo = false);
+
+// Write |aDisplayList| as "%06d.svg" files and info.json into |aSVGPath|,
+// drawing pages on |aThreads| threads (0 for as many as the cores). Files
+// are numbered from |aFirstPage|. With |aArchive|, pages go into that one
+// file (SVGArchive) instead. With |aCompression|, pages are SVGZ
+// ("%06d.svgz") deflated at that level by the same threads. |aPartial| is
+// for a few pages of a book written there before: only their files are
+// replaced, their glyphs are added to glyphs.svg, and info.json is left as
+// is. It can't be used with |aArchive|.
+void emitSVG(const DisplayList& aDisplayList, const char* aSVGPath,
+             uint32_t aThreads = 0, uint32_t aFirstPage = 0,
+             const char* aArchive = nullptr, int aCompression = 0,
+             bool aPartial = false);
+
+// Parse and lay out |aData|, writing every page out as soon as it is laid
+// out, as SVG files into the directory |aSVGPath| (or into the single file
+// |aSVGArchive| there) if given, otherwise as a
+// PDF document through |aWrite| (by cairo if |aCairoPDF|). Shaping, layout and
+// output run on their own threads, and SVG pages are drawn on |aThreads|
+// threads (0: one per core), deflated there if |aSVGCompression| as
+// emitSVG() does. |aWrite| is called on one of them, but never
+// concurrently.
+// @return  The number of pages, i.e. SVG files named "%06d.svg" from zero.
+// @throw std::runtime_error  On font, cairo or I/O errors.
+uint32_t printString(Font* aFont, Font* aHFont, const Page& aPage,
+                 const char* aData, uint32_t aLength,
+                 KihonHanmen& aKihonHanmen,
+                 const double aLineGap, Font* aRubyFont,
+                 const char* aSVGPath,
+                 cairo_write_func_t aWrite, void* aClosure,
+                 std::ostream* aErrorLog = nullptr, Stats* aStats = nullptr,
+                 uint32_t aThreads = 0, bool aCairoPDF = false,
+                 const char* aSVGArchive = nullptr,
+                 int aSVGCompression = 0);
+
+// printString() with the fonts and geometry of resolved |aSettings|.
+uint32_t printDocument(FontCache& aFonts, const Settings& aSettings,
+                       const char* aData, uint32_t aLength,
+                       cairo_write_func_t aWrite, void* aClosure,
+                       std::ostream* aErrorLog = nullptr,
+                       Stats* aStats = nullptr);
+
+// printDocument() on a parsed |aDocument|, e.g. to print one book to several
+// geometries. Windows are shaped through |aShapeCache| if given, which must
+// be used for |aDocument| only.
+uint32_t printDocument(FontCache& aFonts, const Settings& aSettings,
+                       const Document& aDocument,
+                       cairo_write_func_t aWrite, void* aClosure,
+                       ShapeCache* aShapeCache = nullptr);
+
+// printDocument() but only pages |aFirst| to |aLast| (from zero, inclusive).
+// Layout resumes from |aCheckpoints[aFirst]| if there is one, which must come
+// from paginateDocument() on the same |aData| and |aSettings|. Otherwise the
+// pages before are laid out, but not drawn. With "-svgpath", only the files
+// of those pages are replaced and info.json is left as is, so they must be
+// of a book already written there; "-svgarchive" can't be updated this way.
+// @return  The number of pages written.
+// @throw std::runtime_error  With "-svgarchive", if |aCheckpoints[aFirst]| is
+//                            out of |aData|, or as printString() does.
+uint32_t printPages(FontCache& aFonts, const Settings& aSettings,
+                    const char* aData, uint32_t aLength,
+                    uint32_t aFirst, uint32_t aLast,
+                    const std::vector<Checkpoint>& aCheckpoints,
+                    cairo_write_func_t aWrite, void* aClosure,
+                    std::ostream* aErrorLog = nullptr);
+
+} // azlayout
+#endif
@@ -0,0 +1,343 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <fontconfig/fontconfig.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include "batch.h"
+#include "mappedfile.h"
+
+namespace azlayout {
+
+namespace {
+
+struct Job {
+  std::string mInput;
+  std::string mOutput;
+  std::vector<std::string> mArgs;
+  off_t mSize;
+};
+
+// Jobs are dealt to every worker in advance. A worker takes the biggest one
+// left in its own queue, and steals the smallest one from the others when
+// its queue runs dry, so that a few huge novels don't leave cores idle.
+class WorkQueue {
+  std::mutex mMutex;
+  std::deque<uint32_t> mJobs;
+public:
+  void push(uint32_t aJob) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mJobs.push_back(aJob);
+  }
+
+  bool pop(uint32_t& aJob) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mJobs.empty()) {
+      return false;
+    }
+    aJob = mJobs.front();
+    mJobs.pop_front();
+    return true;
+  }
+
+  bool steal(uint32_t& aJob) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mJobs.empty()) {
+      return false;
+    }
+    aJob = mJobs.back();
+    mJobs.pop_back();
+    return true;
+  }
+};
+
+typedef std::vector<std::unique_ptr<WorkQueue>> WorkQueues;
+
+bool nextJob(WorkQueues& aQueues, uint32_t aWorker, uint32_t& aJob) {
+  if (aQueues[aWorker]->pop(aJob)) {
+    return true;
+  }
+  // Nobody adds jobs later, so once all the queues are empty we are done.
+  for (uint32_t i = 1; i < aQueues.size(); i++) {
+    if (aQueues[(aWorker + i) % aQueues.size()]->steal(aJob)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+cairo_status_t caFile(void* aClosure,
+                      const unsigned char aData[],
+                      unsigned int aLength) {
+  FILE* file = static_cast<FILE*>(aClosure);
+  return (aLength == fwrite(aData, 1, aLength, file))?
+    CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
+}
+
+std::vector<const char*> toArgv(const std::vector<std::string>& aArgs) {
+  std::vector<const char*> argv;
+  for (auto& arg : aArgs) {
+    argv.push_back(arg.c_str());
+  }
+  return argv;
+}
+
+// Shaped windows kept for the profiles after the first, in bytes.
+const size_t kProfileShapeCache = 64 * 1024 * 1024;
+
+// An |aOutput| ending with "/" is a directory to write SVG pages into,
+// anything else is a PDF file.
+void printOutput(FontCache& aFonts, const Settings& aSettings,
+                 const Document& aDocument, const std::string& aOutput,
+                 ShapeCache* aShapeCache = nullptr) {
+  Settings settings(aSettings);
+  if ('/' == *(aOutput.end() - 1)) {
+    if (0 != mkdir(aOutput.c_str(), 0755) && EEXIST != errno) {
+      throw std::runtime_error("Can't create the output directory");
+    }
+    settings.mSVGPath = aOutput;
+    printDocument(aFonts, settings, aDocument, nullptr, nullptr, aShapeCache);
+    return;
+  }
+  settings.mSVGPath.clear();
+
+  FILE* file = fopen(aOutput.c_str(), "wb");
+  if (!file) {
+    throw std::runtime_error("Can't open the output");
+  }
+
+  try {
+    printDocument(aFonts, settings, aDocument, caFile, file, aShapeCache);
+  }
+  catch (...) {
+    fclose(file);
+    unlink(aOutput.c_str());
+    throw;
+  }
+
+  if (0 != fclose(file)) {
+    unlink(aOutput.c_str());
+    throw std::runtime_error("Can't write the output");
+  }
+}
+
+void printJob(FontCache& aFonts, const Job& aJob, const Settings& aDefaults) {
+  MappedFile input(aJob.mInput.c_str());
+  input.chomp();
+
+  std::vector<const char*> argv = toArgv(aJob.mArgs);
+  Settings settings(aDefaults);
+  settings.parse(argv.size(), argv.data());
+  if (0 == settings.mThreads) {
+    // Books are already rendered in parallel.
+    settings.mThreads = 1;
+  }
+  settings.resolve();
+
+  Document document;
+  parseDocument(input.data(), input.length(), document);
+  printOutput(aFonts, settings, document, aJob.mOutput);
+}
+
+void work(const std::vector<Job>& aJobs, WorkQueues& aQueues,
+          uint32_t aWorker, FT_Library aFTLib, const Settings& aDefaults,
+          std::atomic<uint32_t>& aFailed) {
+  FontCache fonts(aFTLib);
+  uint32_t job;
+  while (nextJob(aQueues, aWorker, job)) {
+    try {
+      printJob(fonts, aJobs[job], aDefaults);
+    }
+    catch (const std::exception& e) {
+      fprintf(stderr, "%s: %s\n", aJobs[job].mInput.c_str(), e.what());
+      aFailed++;
+    }
+  }
+}
+
+} // namespace
+
+int32_t printBatch(const char* aManifest, uint32_t aThreads,
+                   const Settings& aDefaults) {
+  std::ifstream manifest(aManifest);
+  if (!manifest) {
+    fprintf(stderr, "Can't open %s\n", aManifest);
+    return -1;
+  }
+
+  std::vector<Job> jobs;
+  std::string line;
+  while (std::getline(manifest, line)) {
+    std::istringstream iss(line);
+    Job job;
+    if (!(iss >> job.mInput) || '#' == job.mInput[0]) {
+      continue;
+    }
+    if (!(iss >> job.mOutput)) {
+      fprintf(stderr, "No output for %s\n", job.mInput.c_str());
+      return -1;
+    }
+    std::string arg;
+    while (iss >> arg) {
+      job.mArgs.push_back(arg);
+    }
+
+    struct stat st;
+    job.mSize = (0 == stat(job.mInput.c_str(), &st))? st.st_size : 0;
+    jobs.push_back(job);
+  }
+
+  if (0 == aThreads) {
+    aThreads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  aThreads = std::min(aThreads, std::max(uint32_t(jobs.size()), 1U));
+
+  // Biggest books first, dealt round robin.
+  std::vector<uint32_t> order(jobs.size());
+  for (uint32_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&jobs](uint32_t a, uint32_t b) {
+                     return jobs[a].mSize > jobs[b].mSize;
+                   });
+
+  WorkQueues queues;
+  for (uint32_t i = 0; i < aThreads; i++) {
+    queues.emplace_back(new WorkQueue());
+  }
+  for (uint32_t i = 0; i < order.size(); i++) {
+    queues[i % aThreads]->push(order[i]);
+  }
+
+  // Every worker gets its FT_Library before any job is dealt, so that a
+  // failure here fails the whole batch instead of leaving jobs behind.
+  std::vector<FT_Library> ftlibs;
+  for (uint32_t i = 0; i < aThreads; i++) {
+    FT_Library ftlib;
+    FT_Error fte = FT_Init_FreeType(&ftlib);
+    if (fte) {
+      fprintf(stderr, "FT_Init_FreeType:0x%x\n", fte);
+      for (FT_Library done : ftlibs) {
+        FT_Done_FreeType(done);
+      }
+      return -1;
+    }
+    ftlibs.push_back(ftlib);
+  }
+
+  // Make sure fontconfig is initialized before the workers race for it.
+  FcInit();
+
+  std::atomic<uint32_t> failed(0);
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < aThreads; i++) {
+    workers.emplace_back(work, std::cref(jobs), std::ref(queues), i,
+                         ftlibs[i], std::cref(aDefaults), std::ref(failed));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  for (FT_Library ftlib : ftlibs) {
+    FT_Done_FreeType(ftlib);
+  }
+
+  double seconds = std::chrono::duration<double>
+                     (std::chrono::steady_clock::now() - start).count();
+  fprintf(stderr, "%zu books, %u failed, %u threads, %.2f s, %.2f books/s\n",
+          jobs.size(), failed.load(), aThreads, seconds,
+          (seconds > 0.)? jobs.size() / seconds : 0.);
+
+  return failed;
+}
+
+int32_t printProfiles(const char* aProfiles,
+                      const char* aData, uint32_t aLength,
+                      FontCache& aFonts, const Settings& aDefaults,
+                      std::ostream* aErrorLog) {
+  std::ifstream profiles(aProfiles);
+  if (!profiles) {
+    fprintf(stderr, "Can't open %s\n", aProfiles);
+    return -1;
+  }
+
+  // Parse once, and share shaped windows among the profiles. Each of them is
+  // printed through the pipeline, so only the cache is kept for the book.
+  Document document;
+  parseDocument(aData, aLength, document, aErrorLog);
+  ShapeCache shapeCache(kProfileShapeCache);
+
+  int32_t failed = 0;
+  std::string line;
+  while (std::getline(profiles, line)) {
+    std::istringstream iss(line);
+    std::string output;
+    if (!(iss >> output) || '#' == output[0]) {
+      continue;
+    }
+    std::vector<std::string> args;
+    std::string arg;
+    while (iss >> arg) {
+      args.push_back(arg);
+    }
+
+    std::vector<const char*> argv = toArgv(args);
+    Settings settings(aDefaults);
+    settings.parse(argv.size(), argv.data());
+
+    try {
+      settings.resolve();
+      printOutput(aFonts, settings, document, output, &shapeCache);
+    }
+    catch (const std::exception& e) {
+      fprintf(stderr, "%s: %s\n", output.c_str(), e.what());
+      failed++;
+    }
+  }
+
+  return failed;
+}
+
+} // azlayout
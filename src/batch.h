@@ -0,0 +1,62 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _AZLAYOUT_BATCH_
+#define _AZLAYOUT_BATCH_
+
+#include <stdint.h>
+
+#include "azlayout.h"
+
+namespace azlayout {
+
+// "-batch" mode renders every job listed in the manifest |aManifest| on
+// |aThreads| worker threads, each of which owns its FT_Library and fonts.
+// The manifest has one job per line:
+//
+//   <input> <output> [options]
+//
+// An <output> ending with "/" is a directory to write SVG pages into,
+// anything else is a PDF file. [options] are the same as the command line's
+// and override |aDefaults|. Blank lines and lines starting with '#' are
+// skipped. Paths can't contain white spaces.
+//
+// A job which fails is reported and skipped; the others go on.
+// @return  The number of failed jobs, or -1 if the manifest is unreadable or
+//          FreeType can't be initialized for every worker.
+int32_t printBatch(const char* aManifest, uint32_t aThreads,
+                   const Settings& aDefaults);
+
+// "-profiles" mode renders one book |aData| to several page geometries.
+// |aProfiles| has one output per line:
+//
+//   <output> [options]
+//
+// in the same format as the manifest of "-batch". The book is parsed only
+// once, and runs are shaped only once per font size.
+// @return  The number of failed outputs, or -1 if |aProfiles| is unreadable.
+int32_t printProfiles(const char* aProfiles,
+                      const char* aData, uint32_t aLength,
+                      FontCache& aFonts, const Settings& aDefaults,
+                      std::ostream* aErrorLog = nullptr);
+
+} // azlayout
+#endif
@@ -0,0 +1,125 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include "checkpoint.h"
+
+namespace azlayout {
+
+namespace {
+
+const char kMagic[] = "azlayout-checkpoints 1";
+
+uint64_t hashInput(const char* aData, uint32_t aLength) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (uint32_t i = 0; i < aLength; i++) {
+    hash ^= uint8_t(aData[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+std::string inputLine(const char* aData, uint32_t aLength) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%u %016" PRIx64,
+           aLength, hashInput(aData, aLength));
+  return buffer;
+}
+
+// Everything in resolved |aSettings| that moves a glyph. Output options such
+// as "-svgpath" and "-threads" are left out.
+std::string settingsLine(const Settings& aSettings) {
+  char buffer[512];
+  snprintf(buffer, sizeof(buffer),
+           "%.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %d %.17g",
+           aSettings.mFontSize, aSettings.mRubySize,
+           aSettings.mWidth, aSettings.mHeight,
+           aSettings.mMarginLeft, aSettings.mMarginRight,
+           aSettings.mMarginTop, aSettings.mMarginBottom,
+           aSettings.mLineGap, aSettings.mColumns, aSettings.mColumnGap);
+  std::string line(buffer);
+  line += " ";
+  line += aSettings.mFontFace;
+  line += "/";
+  line += aSettings.mRubyFontFace;
+  return line;
+}
+
+} // namespace
+
+void writeCheckpoints(const char* aPath, const char* aData, uint32_t aLength,
+                      const Settings& aSettings,
+                      const std::vector<PageStart>& aStarts) {
+  std::ofstream ofs(aPath);
+  ofs << kMagic << "\n"
+      << inputLine(aData, aLength) << "\n"
+      << settingsLine(aSettings) << "\n"
+      << aStarts.size() << "\n";
+  for (auto& start : aStarts) {
+    const Checkpoint& c = start.mCheckpoint;
+    ofs << c.mOffset << " " << c.mGlyph << " " << c.mRuby << " "
+        << c.mRubyStart << " " << c.mRubyDataOffset << " " << c.mEm << "\n";
+  }
+  ofs.close();
+  if (!ofs) {
+    throw std::runtime_error(std::string(aPath) + ": " + strerror(errno));
+  }
+}
+
+bool readCheckpoints(const char* aPath, const char* aData, uint32_t aLength,
+                     const Settings& aSettings,
+                     std::vector<Checkpoint>& aCheckpoints) {
+  std::ifstream ifs(aPath);
+  std::string magic, input, settings;
+  if (!std::getline(ifs, magic) || magic != kMagic ||
+      !std::getline(ifs, input) || input != inputLine(aData, aLength) ||
+      !std::getline(ifs, settings) || settings != settingsLine(aSettings)) {
+    return false;
+  }
+
+  // Every page but the first starts with a glyph of its own, so there can't
+  // be more pages than bytes.
+  uint32_t count;
+  if (!(ifs >> count) || count > std::max(aLength, 1U)) {
+    return false;
+  }
+  aCheckpoints.resize(count);
+  for (auto& c : aCheckpoints) {
+    if (!(ifs >> c.mOffset >> c.mGlyph >> c.mRuby >> c.mRubyStart
+              >> c.mRubyDataOffset >> c.mEm)) {
+      aCheckpoints.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+} // azlayout
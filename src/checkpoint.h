@@ -0,0 +1,57 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _AZLAYOUT_CHECKPOINT_
+#define _AZLAYOUT_CHECKPOINT_
+
+#include <stdint.h>
+#include <vector>
+
+#include "azlayout.h"
+
+namespace azlayout {
+
+// A checkpoint file keeps the Checkpoint of every page, so that "-pages"
+// can start drawing at any page right away. It is plain text:
+//
+//   azlayout-checkpoints 1
+//   <input length> <FNV-1a hash of the input>
+//   <the options which affect layout>
+//   <number of pages>
+//   <offset> <glyph> <ruby> <ruby start> <ruby data offset> <em>
+//   ...
+//
+// where the last line repeats for every page.
+
+// @throw std::runtime_error  If |aPath| can't be written.
+void writeCheckpoints(const char* aPath, const char* aData, uint32_t aLength,
+                      const Settings& aSettings,
+                      const std::vector<PageStart>& aStarts);
+
+// @return  false if |aPath| can't be read, was written for another input
+//          or other options, or has more pages than |aData| has bytes.
+//          Offsets are checked against the Document by printPages().
+bool readCheckpoints(const char* aPath, const char* aData, uint32_t aLength,
+                     const Settings& aSettings,
+                     std::vector<Checkpoint>& aCheckpoints);
+
+} // azlayout
+#endif
@@ -0,0 +1,289 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include "daemon.h"
+
+namespace azlayout {
+
+namespace {
+
+class FdReader {
+  int mFd;
+  char mBuffer[4096];
+  size_t mBegin;
+  size_t mEnd;
+  bool mFailed; // read(2) failed, as opposed to EOF.
+
+  bool fill() {
+    ssize_t length;
+    do {
+      length = ::read(mFd, mBuffer, sizeof(mBuffer));
+    } while (length < 0 && EINTR == errno);
+
+    if (length < 0) {
+      mFailed = true;
+    }
+    if (length <= 0) {
+      return false;
+    }
+    mBegin = 0;
+    mEnd = size_t(length);
+    return true;
+  }
+
+public:
+  explicit FdReader(int aFd)
+    : mFd(aFd), mBegin(0), mEnd(0), mFailed(false) {}
+
+  bool failed() const {
+    return mFailed;
+  }
+
+  bool readLine(std::string& aLine) {
+    aLine = "";
+    for (;;) {
+      if (mBegin == mEnd && !fill()) {
+        return false;
+      }
+      const char* start = mBuffer + mBegin;
+      const char* found =
+        static_cast<const char*>(memchr(start, '\n', mEnd - mBegin));
+      if (found) {
+        aLine.append(start, found - start);
+        mBegin += (found - start) + 1;
+        return true;
+      }
+      aLine.append(start, mEnd - mBegin);
+      mBegin = mEnd;
+    }
+  }
+
+  bool read(std::string& aData, size_t aLength) {
+    aData = "";
+    aData.reserve(aLength);
+    while (aData.size() < aLength) {
+      if (mBegin == mEnd && !fill()) {
+        return false;
+      }
+      size_t length = std::min(mEnd - mBegin, aLength - aData.size());
+      aData.append(mBuffer + mBegin, length);
+      mBegin += length;
+    }
+    return true;
+  }
+};
+
+bool writeAll(int aFd, const char* aData, size_t aLength) {
+  while (aLength > 0) {
+    ssize_t written = ::write(aFd, aData, aLength);
+    if (written < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return false;
+    }
+    aData += written;
+    aLength -= written;
+  }
+  return true;
+}
+
+bool writeHeader(int aFd, const char* aStatus, const std::string& aValue) {
+  std::string header(aStatus);
+  header += " ";
+  // Error messages may have line feeds, which would end the header early
+  // and break the framing of every job after.
+  for (char c : aValue) {
+    header += (uint8_t(c) < 0x20 || 0x7f == c)? ' ' : c;
+  }
+  header += "\n";
+  return writeAll(aFd, header.c_str(), header.size());
+}
+
+cairo_status_t caString(void* aClosure,
+                        const unsigned char aData[],
+                        unsigned int aLength) {
+  static_cast<std::string*>(aClosure)->
+    append(reinterpret_cast<const char*>(aData), aLength);
+  return CAIRO_STATUS_SUCCESS;
+}
+
+enum jobStatus {
+  JOB_SERVED,
+  JOB_END,   // The client closed the connection between two jobs.
+  JOB_BROKEN // I/O errors, or a job cut off or framed wrong.
+};
+
+jobStatus serveJob(FdReader& aReader, int aOut, FontCache& aFonts,
+                   const Settings& aDefaults) {
+  std::string options, lengthLine;
+  if (!aReader.readLine(options)) {
+    return (aReader.failed() || !options.empty())? JOB_BROKEN : JOB_END;
+  }
+  if (!aReader.readLine(lengthLine)) {
+    return JOB_BROKEN;
+  }
+
+  char* end = nullptr;
+  unsigned long long length = strtoull(lengthLine.c_str(), &end, 10);
+  if (lengthLine.empty() || *end || length > UINT32_MAX) {
+    // We can't tell where the next job starts any more.
+    writeHeader(aOut, "ERR", "bad length");
+    return JOB_BROKEN;
+  }
+
+  std::string rawUTF8Data;
+  if (!aReader.read(rawUTF8Data, length)) {
+    return JOB_BROKEN;
+  }
+
+  std::vector<std::string> args;
+  {
+    std::istringstream iss(options);
+    std::string arg;
+    while (iss >> arg) {
+      args.push_back(arg);
+    }
+  }
+  std::vector<const char*> argv;
+  for (auto& arg : args) {
+    argv.push_back(arg.c_str());
+  }
+
+  Settings settings(aDefaults);
+  settings.parse(argv.size(), argv.data());
+
+  std::string output;
+  uint32_t pages;
+  try {
+    settings.resolve();
+    pages = printDocument(aFonts, settings,
+                          rawUTF8Data.c_str(), rawUTF8Data.size(),
+                          caString, &output);
+  }
+  catch (const std::exception& e) {
+    return (writeHeader(aOut, "ERR", e.what()))? JOB_SERVED : JOB_BROKEN;
+  }
+
+  const char* svgpath = (settings.mSVGPath.empty())?
+    nullptr : settings.mSVGPath.c_str();
+  if (svgpath) {
+    // Same as what SVGFileNameProvider names them.
+    char dirPath[PATH_MAX];
+    if (!realpath(svgpath, dirPath)) {
+      return (writeHeader(aOut, "ERR", strerror(errno)))?
+        JOB_SERVED : JOB_BROKEN;
+    }
+    if (!settings.mSVGArchive.empty()) {
+      output += dirPath;
+      output += "/";
+      output += settings.mSVGArchive;
+      output += "\n";
+    }
+    else {
+      char fileName[sizeof("/000000.svgz") + 1];
+      for (uint32_t i = 0; i < pages; i++) {
+        snprintf(fileName, sizeof(fileName), "/%06d.%s", i,
+                 (settings.mSVGCompression > 0)? "svgz" : "svg");
+        output += dirPath;
+        output += fileName;
+        output += "\n";
+      }
+    }
+  }
+
+  return (writeHeader(aOut, "OK", std::to_string(output.size())) &&
+          writeAll(aOut, output.c_str(), output.size()))?
+    JOB_SERVED : JOB_BROKEN;
+}
+
+} // namespace
+
+bool serveStream(int aIn, int aOut, FontCache& aFonts,
+                 const Settings& aDefaults) {
+  FdReader reader(aIn);
+  jobStatus status;
+  do {
+    status = serveJob(reader, aOut, aFonts, aDefaults);
+  } while (JOB_SERVED == status);
+  return JOB_END == status;
+}
+
+bool serveUnixSocket(const char* aPath, FontCache& aFonts,
+                     const Settings& aDefaults) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(aPath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Too long socket path: %s\n", aPath);
+    return false;
+  }
+  strncpy(addr.sun_path, aPath, sizeof(addr.sun_path) - 1);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return false;
+  }
+
+  unlink(aPath);
+  if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(listener, 16) < 0) {
+    perror(aPath);
+    close(listener);
+    return false;
+  }
+
+  for (;;) {
+    int connection = accept(listener, nullptr, nullptr);
+    if (connection < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      perror("accept");
+      break;
+    }
+    serveStream(connection, connection, aFonts, aDefaults);
+    close(connection);
+  }
+
+  close(listener);
+  unlink(aPath);
+  return false;
+}
+
+} // azlayout
@@ -0,0 +1,53 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _AZLAYOUT_DAEMON_
+#define _AZLAYOUT_DAEMON_
+
+#include "azlayout.h"
+
+namespace azlayout {
+
+// "-daemon" mode keeps fonts loaded and renders one job after another.
+// Every job is framed as:
+//
+//   Request:  <options>\n<length>\n<length bytes of Aozora Bunko text>
+//   Response: OK <length>\n<length bytes>
+//             ERR <reason>\n
+//
+// <options> are the same as the command line's, e.g.
+// "-size 4.0 -ratio 0.5625 -fontsize 12.0", and override the ones given to
+// the daemon itself. The response is a PDF document, or with "-svgpath" the
+// paths of the SVG pages, one per line (only the archive's with
+// "-svgarchive").
+
+// Serve jobs read from |aIn| until EOF.
+// @return false  On I/O errors, or if a job is cut off or framed wrong.
+bool serveStream(int aIn, int aOut, FontCache& aFonts,
+                 const Settings& aDefaults);
+
+// Listen on the Unix domain socket |aPath| and serve its clients in turn.
+// This returns only on errors.
+bool serveUnixSocket(const char* aPath, FontCache& aFonts,
+                     const Settings& aDefaults);
+
+} // azlayout
+#endif
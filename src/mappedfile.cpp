@@ -0,0 +1,95 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <stdexcept>
+
+#include "mappedfile.h"
+
+namespace azlayout {
+
+MappedFile::MappedFile(const char* aPath)
+  : mData(""), mLength(0), mMap(nullptr), mMapLength(0) {
+  int fd = open(aPath, O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error(std::string(aPath) + ": " + strerror(errno));
+  }
+
+  struct stat st;
+  if (0 == fstat(fd, &st) && S_ISREG(st.st_mode)) {
+    if (uint64_t(st.st_size) > UINT32_MAX) {
+      close(fd);
+      throw std::runtime_error(std::string(aPath) + ": Too big");
+    }
+    if (st.st_size > 0) {
+      void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (MAP_FAILED != map) {
+        // We read it from the beginning to the end only once.
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        mMap = map;
+        mMapLength = st.st_size;
+        mData = static_cast<const char*>(map);
+        mLength = st.st_size;
+      }
+    }
+    if (mMap || 0 == st.st_size) {
+      close(fd);
+      return;
+    }
+  }
+
+  char buffer[65536];
+  ssize_t length;
+  while ((length = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (length < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      close(fd);
+      throw std::runtime_error(std::string(aPath) + ": " + strerror(errno));
+    }
+    mBuffer.append(buffer, length);
+  }
+  close(fd);
+
+  if (mBuffer.size() > UINT32_MAX) {
+    throw std::runtime_error(std::string(aPath) + ": Too big");
+  }
+  mData = mBuffer.c_str();
+  mLength = mBuffer.size();
+}
+
+MappedFile::~MappedFile() {
+  if (mMap) {
+    munmap(mMap, mMapLength);
+  }
+}
+
+} // azlayout
@@ -0,0 +1,61 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _AZLAYOUT_MAPPEDFILE_
+#define _AZLAYOUT_MAPPEDFILE_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+namespace azlayout {
+
+// A whole file, read only. Regular files are mapped into memory instead of
+// being copied; anything else (pipes, devices) is read into a buffer. The
+// constructor throws std::runtime_error if the file can't be read.
+class MappedFile {
+  const char* mData;
+  uint32_t mLength;
+  void* mMap;
+  size_t mMapLength;
+  std::string mBuffer;
+public:
+  explicit MappedFile(const char* aPath);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const {
+    return mData;
+  }
+  uint32_t length() const {
+    return mLength;
+  }
+  // Leave out a trailing line feed as the command line does to stdin.
+  void chomp() {
+    if (mLength > 0 && '\n' == mData[mLength - 1]) {
+      mLength--;
+    }
+  }
+};
+
+} // azlayout
+#endif
@@ -0,0 +1,230 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+
+#include "outputsink.h"
+
+namespace azlayout {
+
+namespace {
+
+// Buffers in flight with the writer thread, plus the one being filled.
+const size_t kAsyncBuffers = 4;
+const size_t kAlignment = 4096;
+
+} // namespace
+
+OutputSink::OutputSink(int aFd, bool aAsync)
+  : mFd(aFd), mOwnsFd(false), mAsync(aAsync) {
+  init();
+}
+
+OutputSink::OutputSink(const char* aPath, bool aAsync)
+  : mFd(-1), mOwnsFd(true), mAsync(aAsync) {
+  mFd = open(aPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (mFd < 0) {
+    throw std::runtime_error(std::string(aPath) + ": " + strerror(errno));
+  }
+  init();
+}
+
+void OutputSink::init() {
+  mError = 0;
+  mFinished = false;
+  mBytes = 0;
+  mWriteSeconds = 0.;
+  mDone = false;
+
+  mBuffers.resize(mAsync? kAsyncBuffers : 1);
+  for (auto& buffer : mBuffers) {
+    void* data = nullptr;
+    if (0 != posix_memalign(&data, kAlignment, kBufferSize)) {
+      for (auto& allocated : mBuffers) {
+        free(allocated.mData);
+      }
+      if (mOwnsFd) {
+        close(mFd);
+      }
+      throw std::bad_alloc();
+    }
+    buffer.mData = static_cast<char*>(data);
+    buffer.mLength = 0;
+  }
+  for (size_t i = 1; i < mBuffers.size(); i++) {
+    mFree.push_back(&mBuffers[i]);
+  }
+  mCurrent = &mBuffers[0];
+
+  if (mAsync) {
+    mWriter = std::thread(&OutputSink::drain, this);
+  }
+}
+
+OutputSink::~OutputSink() {
+  if (!mFinished) {
+    try {
+      finish();
+    }
+    catch (...) {
+    }
+  }
+  for (auto& buffer : mBuffers) {
+    free(buffer.mData);
+  }
+}
+
+void OutputSink::writeBuffer(Buffer* aBuffer) {
+  const char* data = aBuffer->mData;
+  size_t length = aBuffer->mLength;
+  aBuffer->mLength = 0;
+  if (mError) {
+    return;
+  }
+
+  typedef std::chrono::steady_clock clock;
+  clock::time_point start = clock::now();
+  while (length > 0) {
+    ssize_t written = ::write(mFd, data, length);
+    if (written < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      mError = errno;
+      break;
+    }
+    data += written;
+    length -= written;
+    mBytes += written;
+  }
+  mWriteSeconds +=
+    std::chrono::duration<double>(clock::now() - start).count();
+}
+
+void OutputSink::submit(Buffer* aBuffer) {
+  if (!mAsync) {
+    writeBuffer(aBuffer);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mFull.push_back(aBuffer);
+  }
+  mCondition.notify_all();
+}
+
+OutputSink::Buffer* OutputSink::acquire() {
+  if (!mAsync) {
+    // The only buffer has been written synchronously.
+    return mCurrent;
+  }
+  std::unique_lock<std::mutex> lock(mMutex);
+  mCondition.wait(lock, [this] { return !mFree.empty(); });
+  Buffer* buffer = mFree.back();
+  mFree.pop_back();
+  return buffer;
+}
+
+// The writer thread.
+void OutputSink::drain() {
+  std::unique_lock<std::mutex> lock(mMutex);
+  for (;;) {
+    mCondition.wait(lock, [this] { return mDone || !mFull.empty(); });
+    if (mFull.empty()) {
+      // |mDone| and nothing left.
+      return;
+    }
+    Buffer* buffer = mFull.front();
+    mFull.pop_front();
+
+    lock.unlock();
+    writeBuffer(buffer);
+    lock.lock();
+
+    mFree.push_back(buffer);
+    mCondition.notify_all();
+  }
+}
+
+bool OutputSink::append(const char* aData, size_t aLength) {
+  while (aLength > 0) {
+    size_t length = std::min(aLength, kBufferSize - mCurrent->mLength);
+    memcpy(mCurrent->mData + mCurrent->mLength, aData, length);
+    mCurrent->mLength += length;
+    aData += length;
+    aLength -= length;
+
+    if (kBufferSize == mCurrent->mLength) {
+      submit(mCurrent);
+      mCurrent = acquire();
+    }
+  }
+  // With |mAsync|, errors show up a few buffers late. That's still early
+  // enough to stop cairo from going on.
+  return 0 == mError;
+}
+
+void OutputSink::finish() {
+  if (mFinished) {
+    return;
+  }
+  mFinished = true;
+
+  if (mCurrent->mLength > 0) {
+    submit(mCurrent);
+  }
+  if (mAsync) {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mDone = true;
+    }
+    mCondition.notify_all();
+    mWriter.join();
+  }
+
+  int error = mError;
+  if (mOwnsFd && 0 != close(mFd) && 0 == error) {
+    error = errno;
+  }
+  if (error) {
+    throw std::runtime_error(strerror(error));
+  }
+}
+
+cairo_status_t OutputSink::write(void* aClosure,
+                                 const unsigned char aData[],
+                                 unsigned int aLength) {
+  OutputSink* sink = static_cast<OutputSink*>(aClosure);
+  return sink->append(reinterpret_cast<const char*>(aData), aLength)?
+    CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
+}
+
+} // azlayout
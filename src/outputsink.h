@@ -0,0 +1,106 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _AZLAYOUT_OUTPUTSINK_
+#define _AZLAYOUT_OUTPUTSINK_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cairo.h>
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+namespace azlayout {
+
+// Where cairo_pdf_surface_create_for_stream() writes to. Bytes are gathered
+// into large page-aligned buffers and handed to write(2) a buffer at a time.
+// With |aAsync| a writer thread drains the full buffers, so that layout and
+// emission don't wait on the disk or the pipe unless every buffer is in
+// flight.
+class OutputSink {
+  struct Buffer {
+    char* mData;
+    size_t mLength;
+  };
+
+  int mFd;
+  bool mOwnsFd;
+  bool mAsync;
+  std::vector<Buffer> mBuffers;
+  Buffer* mCurrent;
+  // The first errno write(2) gave us. Everything after it is dropped.
+  std::atomic<int> mError;
+  bool mFinished;
+  uint64_t mBytes;
+  double mWriteSeconds;
+
+  // For |mAsync| only.
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::deque<Buffer*> mFull;
+  std::vector<Buffer*> mFree;
+  bool mDone;
+  std::thread mWriter;
+
+  void init();
+  void writeBuffer(Buffer* aBuffer);
+  void submit(Buffer* aBuffer);
+  Buffer* acquire();
+  void drain();
+public:
+  static const size_t kBufferSize = 1 << 20;
+
+  // |aFd| is left open.
+  OutputSink(int aFd, bool aAsync);
+  // Create (or truncate) |aPath|. This throws std::runtime_error if it can't.
+  OutputSink(const char* aPath, bool aAsync);
+  // Flushes what is left, but errors can be told only by finish().
+  ~OutputSink();
+  OutputSink(const OutputSink&) = delete;
+  OutputSink& operator=(const OutputSink&) = delete;
+
+  bool append(const char* aData, size_t aLength);
+
+  // Flush everything and wait for the writer. This throws
+  // std::runtime_error if any write failed.
+  void finish();
+
+  // What has been written so far, and the time spent in write(2).
+  uint64_t bytes() const {
+    return mBytes;
+  }
+  double writeSeconds() const {
+    return mWriteSeconds;
+  }
+
+  // cairo_write_func_t, with an OutputSink* as |aClosure|.
+  static cairo_status_t write(void* aClosure,
+                              const unsigned char aData[],
+                              unsigned int aLength);
+};
+
+} // azlayout
+#endif
@@ -0,0 +1,536 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <zlib.h>
+
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+#include "pdfwriter.h"
+#include "utf8.h"
+
+namespace azlayout {
+
+namespace {
+
+// Positions are written in 1/100 pt, advances in 1/1000 pt so that TJ
+// adjustments (in 1/1000 of text space) don't drift along a line.
+double appendNumber(std::string& aOut, double aValue, int aDecimals = 2) {
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "%.*f", aDecimals, aValue);
+  const double written = atof(buffer);
+  while (aDecimals > 0 && '0' == buffer[length - 1]) {
+    length--;
+  }
+  if ('.' == buffer[length - 1]) {
+    length--;
+  }
+  if (2 == length && '-' == buffer[0] && '0' == buffer[1]) {
+    buffer[0] = '0';
+    length = 1;
+  }
+  aOut.append(buffer, length);
+  return written;
+}
+
+void appendInteger(std::string& aOut, uint64_t aValue) {
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "%llu",
+                        (unsigned long long)aValue);
+  aOut.append(buffer, length);
+}
+
+void appendHex(std::string& aOut, uint32_t aValue, int aDigits) {
+  static const char kDigits[] = "0123456789abcdef";
+  for (int i = aDigits - 1; i >= 0; i--) {
+    aOut += kDigits[(aValue >> (i * 4)) & 0xf];
+  }
+}
+
+// Text space has u along the line, i.e. down the page, and v to the left of
+// it. User space is cairo's, with y down.
+//   x = -v, y = u
+const char kTextMatrix[] = "0 1 -1 0 0 0 Tm\n";
+
+// FT_Outline_Decompose() into a glyph procedure, in text space.
+struct ProcBuilder {
+  std::string& mProc;
+  cairo_matrix_t mMatrix;
+  FT_Vector mLast;
+
+  ProcBuilder(std::string& aProc, const cairo_matrix_t& aMatrix,
+              FT_UShort aUnitsPerEM) :
+    mProc(aProc), mMatrix(aMatrix), mLast() {
+    cairo_matrix_t units;
+    cairo_matrix_init_scale(&units, 1. / aUnitsPerEM, -1. / aUnitsPerEM);
+    cairo_matrix_multiply(&mMatrix, &units, &aMatrix);
+  }
+
+  void point(const FT_Vector* aPoint) {
+    double x = aPoint->x, y = aPoint->y;
+    cairo_matrix_transform_point(&mMatrix, &x, &y);
+    appendNumber(mProc, y);
+    mProc += ' ';
+    appendNumber(mProc, -x);
+    mProc += ' ';
+  }
+
+  static int moveTo(const FT_Vector* aTo, void* aUser) {
+    ProcBuilder* self = static_cast<ProcBuilder*>(aUser);
+    self->point(aTo);
+    self->mProc += "m\n";
+    self->mLast = *aTo;
+    return 0;
+  }
+
+  static int lineTo(const FT_Vector* aTo, void* aUser) {
+    ProcBuilder* self = static_cast<ProcBuilder*>(aUser);
+    self->point(aTo);
+    self->mProc += "l\n";
+    self->mLast = *aTo;
+    return 0;
+  }
+
+  // PDF has only cubic curves.
+  static int conicTo(const FT_Vector* aControl, const FT_Vector* aTo,
+                     void* aUser) {
+    ProcBuilder* self = static_cast<ProcBuilder*>(aUser);
+    FT_Vector control1, control2;
+    control1.x = self->mLast.x + (2 * (aControl->x - self->mLast.x)) / 3;
+    control1.y = self->mLast.y + (2 * (aControl->y - self->mLast.y)) / 3;
+    control2.x = aTo->x + (2 * (aControl->x - aTo->x)) / 3;
+    control2.y = aTo->y + (2 * (aControl->y - aTo->y)) / 3;
+    return cubicTo(&control1, &control2, aTo, aUser);
+  }
+
+  static int cubicTo(const FT_Vector* aControl1, const FT_Vector* aControl2,
+                     const FT_Vector* aTo, void* aUser) {
+    ProcBuilder* self = static_cast<ProcBuilder*>(aUser);
+    self->point(aControl1);
+    self->point(aControl2);
+    self->point(aTo);
+    self->mProc += "c\n";
+    self->mLast = *aTo;
+    return 0;
+  }
+};
+
+void appendUTF16(std::string& aOut, uint32_t aCodepoint) {
+  if (aCodepoint < 0x10000) {
+    appendHex(aOut, aCodepoint, 4);
+    return;
+  }
+  aCodepoint -= 0x10000;
+  appendHex(aOut, 0xD800 | (aCodepoint >> 10), 4);
+  appendHex(aOut, 0xDC00 | (aCodepoint & 0x3FF), 4);
+}
+
+// The state of a text object, to write only what changes.
+class TextWriter {
+  std::string& mOut;
+  uint32_t mSubfont;
+  bool mInArray;
+  bool mInString;
+  // The start of the line and the current point, in text space.
+  double mLineU;
+  double mLineV;
+  double mPen;
+
+  void closeString() {
+    if (mInString) {
+      mOut += '>';
+      mInString = false;
+    }
+  }
+  void closeArray() {
+    closeString();
+    if (mInArray) {
+      mOut += "]TJ\n";
+      mInArray = false;
+    }
+  }
+public:
+  explicit TextWriter(std::string& aOut) :
+    mOut(aOut), mSubfont(UINT32_MAX), mInArray(false), mInString(false),
+    mLineU(0.), mLineV(0.), mPen(0.) {}
+
+  ~TextWriter() {
+    closeArray();
+  }
+
+  void show(uint32_t aSubfont, uint8_t aCode, double aWidth,
+            double aU, double aV) {
+    if (aSubfont != mSubfont) {
+      closeArray();
+      mOut += "/F";
+      appendInteger(mOut, aSubfont);
+      mOut += " 1 Tf\n";
+      mSubfont = aSubfont;
+    }
+
+    if (fabs(aV - mLineV) > 0.005) {
+      // Another line.
+      closeArray();
+      mLineU += appendNumber(mOut, aU - mLineU);
+      mOut += ' ';
+      mLineV += appendNumber(mOut, aV - mLineV);
+      mOut += " Td\n";
+      mPen = mLineU;
+    }
+
+    if (!mInArray) {
+      mOut += '[';
+      mInArray = true;
+    }
+    double adjustment = ::round((mPen - aU) * 1000.);
+    if (0. != adjustment) {
+      closeString();
+      appendNumber(mOut, adjustment, 0);
+      mPen -= adjustment / 1000.;
+    }
+    if (!mInString) {
+      mOut += '<';
+      mInString = true;
+    }
+    appendHex(mOut, aCode, 2);
+    mPen += aWidth;
+  }
+};
+
+} // namespace
+
+PDFWriter::PDFWriter(cairo_write_func_t aWrite, void* aClosure,
+                     double aWidth, double aHeight) :
+  mWrite(aWrite), mClosure(aClosure), mWidth(aWidth), mHeight(aHeight),
+  mWritten(0), mOffsets(4, 0), mFinished(false) {
+  // A binary comment tells file transfers that this isn't text.
+  mBuffer = "%PDF-1.4\n%\xE2\xE3\xCF\xD3\n";
+}
+
+uint32_t PDFWriter::newObject() {
+  mOffsets.push_back(0);
+  return mOffsets.size() - 1;
+}
+
+void PDFWriter::beginObject(uint32_t aObject) {
+  mOffsets[aObject] = mWritten + mBuffer.size();
+  appendInteger(mBuffer, aObject);
+  mBuffer += " 0 obj\n";
+}
+
+void PDFWriter::writeStream(uint32_t aObject, const std::string& aData) {
+  uLongf length = compressBound(aData.size());
+  std::string deflated(length, '\0');
+  if (Z_OK != compress2(reinterpret_cast<Bytef*>(&deflated[0]), &length,
+                        reinterpret_cast<const Bytef*>(aData.data()),
+                        aData.size(), Z_DEFAULT_COMPRESSION)) {
+    throw std::runtime_error("PDF: compress2 failed");
+  }
+
+  beginObject(aObject);
+  mBuffer += "<< /Length ";
+  appendInteger(mBuffer, length);
+  mBuffer += " /Filter /FlateDecode >>\nstream\n";
+  mBuffer.append(deflated.data(), length);
+  mBuffer += "\nendstream\nendobj\n";
+}
+
+void PDFWriter::flush() {
+  if (mBuffer.empty()) {
+    return;
+  }
+  if (CAIRO_STATUS_SUCCESS !=
+      mWrite(mClosure, reinterpret_cast<const unsigned char*>(mBuffer.data()),
+             mBuffer.size())) {
+    throw std::runtime_error("PDF: write error");
+  }
+  mWritten += mBuffer.size();
+  mBuffer.clear();
+}
+
+void PDFWriter::defineGlyph(Subfont& aSubfont, uint32_t aGlyph) {
+  const Font* font = aSubfont.mFont;
+  std::string proc;
+  double width = 0.;
+
+  FT_GlyphSlot slot = font->loadOutline(aGlyph);
+  if (slot) {
+    const FT_UShort unitsPerEM = font->mFTCAFont->units_per_EM;
+    // For vertical fonts FreeType gives (0, vertAdvance), i.e. downwards.
+    double x = double(slot->advance.x) / unitsPerEM;
+    double y = double(slot->advance.y) / unitsPerEM;
+    cairo_matrix_transform_distance(&font->mMatrix, &x, &y);
+    width = y;
+
+    ProcBuilder builder(proc, font->mMatrix, unitsPerEM);
+    FT_Outline_Funcs funcs;
+    funcs.move_to = &ProcBuilder::moveTo;
+    funcs.line_to = &ProcBuilder::lineTo;
+    funcs.conic_to = &ProcBuilder::conicTo;
+    funcs.cubic_to = &ProcBuilder::cubicTo;
+    funcs.shift = 0;
+    funcs.delta = 0;
+    FT_Outline_Decompose(&slot->outline, &funcs, &builder);
+  }
+  // XXX Bitmap-only glyphs are left empty.
+
+  std::string head;
+  width = appendNumber(head, width, 3);
+  head += " 0 d0\n";
+  if (!proc.empty()) {
+    proc += "f\n";
+  }
+
+  aSubfont.mGlyphs.push_back(aGlyph);
+  aSubfont.mWidths.push_back(width);
+  aSubfont.mProcs.push_back(head + proc);
+  aSubfont.mText.push_back(std::string());
+}
+
+uint32_t PDFWriter::code(const Font* aFont, uint32_t aGlyph) {
+  uint32_t fontIndex = std::find(mFonts.begin(), mFonts.end(), aFont) -
+                       mFonts.begin();
+  if (fontIndex == mFonts.size()) {
+    mFonts.push_back(aFont);
+  }
+
+  uint64_t key = (uint64_t(fontIndex) << 32) | aGlyph;
+  auto found = mCodes.find(key);
+  if (found != mCodes.end()) {
+    return found->second;
+  }
+
+  // The last subfont of |aFont| if it has room, otherwise a new one.
+  uint32_t subfont = mSubfonts.size();
+  for (uint32_t i = mSubfonts.size(); i > 0; i--) {
+    if (mSubfonts[i - 1].mFont == aFont) {
+      if (mSubfonts[i - 1].mGlyphs.size() < 256) {
+        subfont = i - 1;
+      }
+      break;
+    }
+  }
+  if (subfont == mSubfonts.size()) {
+    mSubfonts.push_back(Subfont());
+    mSubfonts.back().mFont = aFont;
+  }
+
+  uint32_t code = (subfont << 8) | mSubfonts[subfont].mGlyphs.size();
+  defineGlyph(mSubfonts[subfont], aGlyph);
+  mCodes[key] = code;
+  return code;
+}
+
+// Give the glyphs of |aRun| the text of their clusters, so that viewers can
+// search and copy it. The first glyph of a cluster takes the whole of it.
+void PDFWriter::mapText(const GlyphRun& aRun) {
+  uint32_t byte = 0, glyph = 0;
+  for (auto& cluster : aRun.mClusters) {
+    if (cluster.num_glyphs > 0 && glyph < aRun.mGlyphs.size() &&
+        byte + cluster.num_bytes <= aRun.mText.size()) {
+      uint32_t found = code(aRun.mFont, aRun.mGlyphs[glyph].index);
+      std::string& text = mSubfonts[found >> 8].mText[found & 0xff];
+      if (text.empty()) {
+        DecodedUTF8 decoded;
+        decodeUTF8(aRun.mText.data() + byte, cluster.num_bytes, decoded);
+        for (uint32_t codepoint : decoded.mCodepoints) {
+          appendUTF16(text, codepoint);
+        }
+      }
+    }
+    byte += cluster.num_bytes;
+    glyph += cluster.num_glyphs;
+  }
+}
+
+void PDFWriter::addPage(const PageDisplayList& aPage) {
+  std::string content("q 1 0 0 -1 0 ");
+  appendNumber(content, mHeight);
+  content += " cm\nBT\n";
+  content += kTextMatrix;
+  {
+    TextWriter text(content);
+    for (auto* runs : {&aPage.mRuns, &aPage.mAnnotations}) {
+      for (auto& run : *runs) {
+        for (auto& glyph : run.mGlyphs) {
+          uint32_t found = code(run.mFont, glyph.index);
+          const Subfont& subfont = mSubfonts[found >> 8];
+          text.show(found >> 8, found & 0xff, subfont.mWidths[found & 0xff],
+                    glyph.y, -glyph.x);
+        }
+        mapText(run);
+      }
+    }
+  }
+  content += "ET\nQ\n";
+
+  uint32_t contents = newObject();
+  writeStream(contents, content);
+
+  uint32_t page = newObject();
+  beginObject(page);
+  mBuffer += "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 ";
+  appendNumber(mBuffer, mWidth);
+  mBuffer += ' ';
+  appendNumber(mBuffer, mHeight);
+  mBuffer += "] /Resources 3 0 R /Contents ";
+  appendInteger(mBuffer, contents);
+  mBuffer += " 0 R >>\nendobj\n";
+  mPages.push_back(page);
+
+  flush();
+}
+
+void PDFWriter::writeFont(const Subfont& aSubfont, uint32_t aObject) {
+  const uint32_t count = aSubfont.mGlyphs.size();
+
+  std::vector<uint32_t> procs(count);
+  for (uint32_t i = 0; i < count; i++) {
+    procs[i] = newObject();
+    writeStream(procs[i], aSubfont.mProcs[i]);
+  }
+
+  std::string cmap("/CIDInit /ProcSet findresource begin\n"
+                   "12 dict begin\nbegincmap\n"
+                   "/CIDSystemInfo << /Registry (Adobe) /Ordering (UCS) "
+                   "/Supplement 0 >> def\n"
+                   "/CMapName /Adobe-Identity-UCS def\n/CMapType 2 def\n"
+                   "1 begincodespacerange\n<00> <ff>\nendcodespacerange\n");
+  std::vector<uint32_t> mapped;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!aSubfont.mText[i].empty()) {
+      mapped.push_back(i);
+    }
+  }
+  // No more than 100 entries a block.
+  for (size_t i = 0; i < mapped.size(); i += 100) {
+    size_t end = std::min(mapped.size(), i + 100);
+    appendInteger(cmap, end - i);
+    cmap += " beginbfchar\n";
+    for (size_t j = i; j < end; j++) {
+      cmap += '<';
+      appendHex(cmap, mapped[j], 2);
+      cmap += "> <";
+      cmap += aSubfont.mText[mapped[j]];
+      cmap += ">\n";
+    }
+    cmap += "endbfchar\n";
+  }
+  cmap += "endcmap\nCMapName currentdict /CMap defineresource pop\n"
+          "end\nend\n";
+  uint32_t toUnicode = newObject();
+  writeStream(toUnicode, cmap);
+
+  beginObject(aObject);
+  mBuffer += "<< /Type /Font /Subtype /Type3 /FontBBox [0 0 0 0] "
+             "/FontMatrix [1 0 0 1 0 0] /Resources << >>\n/FirstChar 0 "
+             "/LastChar ";
+  appendInteger(mBuffer, count - 1);
+  mBuffer += "\n/Widths [";
+  for (uint32_t i = 0; i < count; i++) {
+    appendNumber(mBuffer, aSubfont.mWidths[i], 3);
+    mBuffer += ' ';
+  }
+  mBuffer += "]\n/Encoding << /Type /Encoding /Differences [0";
+  for (uint32_t i = 0; i < count; i++) {
+    mBuffer += " /g";
+    appendInteger(mBuffer, i);
+  }
+  mBuffer += "] >>\n/CharProcs <<";
+  for (uint32_t i = 0; i < count; i++) {
+    mBuffer += " /g";
+    appendInteger(mBuffer, i);
+    mBuffer += ' ';
+    appendInteger(mBuffer, procs[i]);
+    mBuffer += " 0 R";
+  }
+  mBuffer += " >>\n/ToUnicode ";
+  appendInteger(mBuffer, toUnicode);
+  mBuffer += " 0 R >>\nendobj\n";
+  flush();
+}
+
+void PDFWriter::finish() {
+  if (mFinished) {
+    return;
+  }
+  mFinished = true;
+
+  std::vector<uint32_t> fonts(mSubfonts.size());
+  for (auto& font : fonts) {
+    font = newObject();
+  }
+  for (size_t i = 0; i < mSubfonts.size(); i++) {
+    writeFont(mSubfonts[i], fonts[i]);
+  }
+
+  beginObject(3);
+  mBuffer += "<< /Font <<";
+  for (size_t i = 0; i < fonts.size(); i++) {
+    mBuffer += " /F";
+    appendInteger(mBuffer, i);
+    mBuffer += ' ';
+    appendInteger(mBuffer, fonts[i]);
+    mBuffer += " 0 R";
+  }
+  mBuffer += " >> >>\nendobj\n";
+
+  beginObject(2);
+  mBuffer += "<< /Type /Pages /Kids [";
+  for (auto page : mPages) {
+    appendInteger(mBuffer, page);
+    mBuffer += " 0 R ";
+  }
+  mBuffer += "] /Count ";
+  appendInteger(mBuffer, mPages.size());
+  mBuffer += " >>\nendobj\n";
+
+  beginObject(1);
+  mBuffer += "<< /Type /Catalog /Pages 2 0 R >>\nendobj\n";
+
+  const uint64_t xref = mWritten + mBuffer.size();
+  mBuffer += "xref\n0 ";
+  appendInteger(mBuffer, mOffsets.size());
+  mBuffer += "\n0000000000 65535 f \n";
+  char entry[32];
+  for (size_t i = 1; i < mOffsets.size(); i++) {
+    snprintf(entry, sizeof(entry), "%010llu 00000 n \n",
+             (unsigned long long)mOffsets[i]);
+    mBuffer += entry;
+  }
+  mBuffer += "trailer\n<< /Size ";
+  appendInteger(mBuffer, mOffsets.size());
+  mBuffer += " /Root 1 0 R >>\nstartxref\n";
+  appendInteger(mBuffer, xref);
+  mBuffer += "\n%%EOF\n";
+  flush();
+}
+
+} // azlayout
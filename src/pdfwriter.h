@@ -0,0 +1,95 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _AZLAYOUT_PDFWRITER_
+#define _AZLAYOUT_PDFWRITER_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "azlayout.h"
+
+namespace azlayout {
+
+// A PDF writer for what our pages are made of, i.e. glyphs and nothing else,
+// straight from PageDisplayList. Every page goes out through |aWrite| as soon
+// as it is added, and the fonts, the page tree and the cross references
+// follow at finish().
+//
+// Glyphs are embedded as Type 3 fonts of 256 glyphs each, drawn from the
+// outlines Font::loadOutline() gives. That is what cairo does for vertical
+// fonts as well, since no font program has their vertical origins, and only
+// the glyphs actually used get into the file. A line is one TJ operator in a
+// text space rotated to run down the page, so that positions are spelt out
+// only where they differ from the advances.
+class PDFWriter {
+  struct Subfont {
+    const Font* mFont;
+    std::vector<uint32_t> mGlyphs;
+    std::vector<double> mWidths;
+    std::vector<std::string> mProcs;
+    // UTF-16BE in hex for ToUnicode, empty if unknown.
+    std::vector<std::string> mText;
+  };
+
+  cairo_write_func_t mWrite;
+  void* mClosure;
+  double mWidth;
+  double mHeight;
+  std::string mBuffer;
+  uint64_t mWritten;
+  // By object number. 1 to 3 are the catalog, the page tree and the
+  // resources shared by every page.
+  std::vector<uint64_t> mOffsets;
+  std::vector<uint32_t> mPages;
+  std::vector<const Font*> mFonts;
+  std::vector<Subfont> mSubfonts;
+  // (font, glyph) -> (subfont << 8) | code
+  std::unordered_map<uint64_t, uint32_t> mCodes;
+  bool mFinished;
+
+  uint32_t newObject();
+  void beginObject(uint32_t aObject);
+  void writeStream(uint32_t aObject, const std::string& aData);
+  void flush();
+  uint32_t code(const Font* aFont, uint32_t aGlyph);
+  void defineGlyph(Subfont& aSubfont, uint32_t aGlyph);
+  void mapText(const GlyphRun& aRun);
+  void writeFont(const Subfont& aSubfont, uint32_t aObject);
+public:
+  PDFWriter(cairo_write_func_t aWrite, void* aClosure,
+            double aWidth, double aHeight);
+  PDFWriter(const PDFWriter&) = delete;
+  PDFWriter& operator=(const PDFWriter&) = delete;
+
+  // Write |aPage| out. Fonts must not be used by other threads meanwhile.
+  // @throw std::runtime_error  If |aWrite| fails.
+  void addPage(const PageDisplayList& aPage);
+
+  // Write the rest of the document.
+  // @throw std::runtime_error  If |aWrite| fails.
+  void finish();
+};
+
+} // azlayout
+#endif
@@ -0,0 +1,68 @@
+/* 
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _SCRIPT_
+#define _SCRIPT_
+namespace script {
+
+// A rough Unicode script of a code point, just enough to tell kanji from
+// kana and Latin letters.
+enum category {
+  Other = 0x0,
+  Han   = 0x1,
+  Kana  = 0x2, // Hiragana and Katakana
+  Latin = 0x3
+};
+
+// Generated by script.js from the Scripts.txt of the Unicode version pinned
+// in CMakeLists.txt, in the same way as utr50::gStage1 and gStage2.
+const unsigned int kStage1Length = (0x110000 >> 8) + 1;
+extern const unsigned char gStage1[kStage1Length];
+extern const unsigned char gStage2[];
+
+inline category getCategory(unsigned int aUnicodeCodePoint) {
+  unsigned int block = aUnicodeCodePoint >> 8;
+  block = (block < kStage1Length)? block : kStage1Length - 1;
+  unsigned int index = (gStage1[block] << 6) | ((aUnicodeCodePoint & 0xff) >> 2);
+  return category((gStage2[index] >> ((aUnicodeCodePoint & 3) << 1)) & 3);
+}
+
+// The Unicode version of the tables, e.g. "15.0.0".
+extern const char kUnicodeVersion[];
+
+const char* categoryName(category aCategory);
+
+// A code point on which getCategory() and ICU's uscript_getScript()
+// disagree, with what each of them says.
+struct Mismatch {
+  unsigned int mCodePoint; // 0x110000 if none.
+  category mTable;
+  category mICU;
+  // ICU may be of another Unicode version than the tables, in which case
+  // only the code points assigned in both are compared.
+  bool mAllCodePoints;
+  char mICUVersion[20];    // U_MAX_VERSION_STRING_LENGTH
+};
+
+Mismatch firstMismatch();
+
+}
+#endif
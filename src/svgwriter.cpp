@@ -0,0 +1,393 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_OUTLINE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+#include "svgwriter.h"
+
+namespace azlayout {
+
+const char kSVGGlyphsLeaf[] = "glyphs.svg";
+
+namespace {
+
+// Two decimal places are far finer than any screen or printer, e.g.
+// "12.5" for 12.5, "-3" for -3.001.
+void appendNumber(std::string& aOut, double aValue) {
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "%.2f", aValue);
+  while (length > 0 && '0' == buffer[length - 1]) {
+    length--;
+  }
+  if (length > 0 && '.' == buffer[length - 1]) {
+    length--;
+  }
+  if (2 == length && '-' == buffer[0] && '0' == buffer[1]) {
+    buffer[0] = '0';
+    length = 1;
+  }
+  aOut.append(buffer, length);
+}
+
+void appendGlyphId(std::string& aOut, uint32_t aFontIndex, uint32_t aGlyph) {
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "g%u-%u", aFontIndex, aGlyph);
+  aOut.append(buffer, length);
+}
+
+// FT_Outline_Decompose() into SVG path data, from font units to the user
+// space of the page.
+struct PathBuilder {
+  std::string& mPath;
+  cairo_matrix_t mMatrix;
+  bool mOpen;
+
+  PathBuilder(std::string& aPath, const cairo_matrix_t& aMatrix,
+              FT_UShort aUnitsPerEM) :
+    mPath(aPath), mMatrix(aMatrix), mOpen(false) {
+    // Font units are y-up, where cairo's glyph space is y-down with 1 em.
+    cairo_matrix_t units;
+    cairo_matrix_init_scale(&units, 1. / aUnitsPerEM, -1. / aUnitsPerEM);
+    cairo_matrix_multiply(&mMatrix, &units, &aMatrix);
+  }
+
+  void point(const FT_Vector* aPoint) {
+    double x = aPoint->x, y = aPoint->y;
+    cairo_matrix_transform_point(&mMatrix, &x, &y);
+    appendNumber(mPath, x);
+    mPath += ' ';
+    appendNumber(mPath, y);
+  }
+
+  static int moveTo(const FT_Vector* aTo, void* aUser) {
+    PathBuilder* self = static_cast<PathBuilder*>(aUser);
+    self->mPath += (self->mOpen)? "ZM" : "M";
+    self->point(aTo);
+    self->mOpen = true;
+    return 0;
+  }
+
+  static int lineTo(const FT_Vector* aTo, void* aUser) {
+    PathBuilder* self = static_cast<PathBuilder*>(aUser);
+    self->mPath += 'L';
+    self->point(aTo);
+    return 0;
+  }
+
+  static int conicTo(const FT_Vector* aControl, const FT_Vector* aTo,
+                     void* aUser) {
+    PathBuilder* self = static_cast<PathBuilder*>(aUser);
+    self->mPath += 'Q';
+    self->point(aControl);
+    self->mPath += ' ';
+    self->point(aTo);
+    return 0;
+  }
+
+  static int cubicTo(const FT_Vector* aControl1, const FT_Vector* aControl2,
+                     const FT_Vector* aTo, void* aUser) {
+    PathBuilder* self = static_cast<PathBuilder*>(aUser);
+    self->mPath += 'C';
+    self->point(aControl1);
+    self->mPath += ' ';
+    self->point(aControl2);
+    self->mPath += ' ';
+    self->point(aTo);
+    return 0;
+  }
+};
+
+void writeFile(const char* aPath, const std::string& aData) {
+  FILE* file = fopen(aPath, "wb");
+  if (!file) {
+    throw std::runtime_error(std::string(aPath) + ": " + strerror(errno));
+  }
+  size_t written = fwrite(aData.data(), 1, aData.size(), file);
+  if (0 != fclose(file) || written != aData.size()) {
+    throw std::runtime_error(std::string(aPath) + ": " + strerror(errno));
+  }
+}
+
+} // namespace
+
+std::string SVGGlyphs::defineGlyph(const Font* aFont, uint32_t aFontIndex,
+                                   uint32_t aGlyph) {
+  std::string def("<path id=\"");
+  appendGlyphId(def, aFontIndex, aGlyph);
+  def += "\" d=\"";
+
+  FT_GlyphSlot slot = aFont->loadOutline(aGlyph);
+  if (slot) {
+    PathBuilder builder(def, aFont->mMatrix,
+                        aFont->mFTCAFont->units_per_EM);
+    FT_Outline_Funcs funcs;
+    funcs.move_to = &PathBuilder::moveTo;
+    funcs.line_to = &PathBuilder::lineTo;
+    funcs.conic_to = &PathBuilder::conicTo;
+    funcs.cubic_to = &PathBuilder::cubicTo;
+    funcs.shift = 0;
+    funcs.delta = 0;
+    FT_Outline_Decompose(&slot->outline, &funcs, &builder);
+    if (builder.mOpen) {
+      def += 'Z';
+    }
+  }
+  // XXX Bitmap-only glyphs are left empty.
+  def += "\"/>\n";
+  return def;
+}
+
+uint32_t SVGGlyphs::define(const GlyphRun& aRun) {
+  // |mFonts| never changes, so no need to lock for this.
+  uint32_t fontIndex = std::find(mFonts.begin(), mFonts.end(), aRun.mFont) -
+                       mFonts.begin();
+  if (fontIndex == mFonts.size()) {
+    throw std::runtime_error("SVGGlyphs: A run of an unknown font");
+  }
+
+  // Outlines are loaded and formatted without |mMutex|, so that pages of
+  // other threads don't wait for them unless they need the same font.
+  std::vector<uint32_t> missing;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (auto& glyph : aRun.mGlyphs) {
+      uint64_t key = (uint64_t(fontIndex) << 32) | uint32_t(glyph.index);
+      if (mDefs.find(key) == mDefs.end()) {
+        missing.push_back(glyph.index);
+      }
+    }
+  }
+  if (missing.empty()) {
+    return fontIndex;
+  }
+  std::sort(missing.begin(), missing.end());
+  missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+  // Always |mLoadMutexes| first, then |mMutex|.
+  std::lock_guard<std::mutex> loadLock(mLoadMutexes[fontIndex]);
+  {
+    // The thread which had the font before may have defined some of them.
+    std::lock_guard<std::mutex> lock(mMutex);
+    missing.erase(std::remove_if(missing.begin(), missing.end(),
+                                 [&](uint32_t aGlyph) {
+                                   return mDefs.count(
+                                     (uint64_t(fontIndex) << 32) | aGlyph);
+                                 }),
+                  missing.end());
+  }
+  std::vector<std::pair<uint64_t, std::string>> defs;
+  for (uint32_t glyph : missing) {
+    defs.emplace_back((uint64_t(fontIndex) << 32) | glyph,
+                      defineGlyph(aRun.mFont, fontIndex, glyph));
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  for (auto& def : defs) {
+    mDefs.insert(std::move(def));
+  }
+  return fontIndex;
+}
+
+// Every <path> of a glyphs.svg which write() wrote is on a line of its own.
+// The ones defined in this run are newer, and win.
+void SVGGlyphs::read(const char* aPath) {
+  FILE* file = fopen(aPath, "rb");
+  if (!file) {
+    if (ENOENT == errno) {
+      return;
+    }
+    throw std::runtime_error(std::string(aPath) + ": " + strerror(errno));
+  }
+
+  std::string line;
+  int c;
+  while (EOF != (c = getc(file))) {
+    line += char(c);
+    if ('\n' != c) {
+      continue;
+    }
+    unsigned int fontIndex, glyph;
+    if (2 == sscanf(line.c_str(), "<path id=\"g%u-%u\"", &fontIndex, &glyph)) {
+      uint64_t key = (uint64_t(fontIndex) << 32) | glyph;
+      if (mDefs.find(key) == mDefs.end()) {
+        mDefs[key] = line;
+      }
+    }
+    line.clear();
+  }
+
+  bool failed = ferror(file);
+  fclose(file);
+  if (failed) {
+    throw std::runtime_error(std::string(aPath) + ": Can't read");
+  }
+}
+
+void SVGGlyphs::write(const char* aPath, bool aMerge) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (aMerge) {
+    read(aPath);
+  }
+  std::string svg("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                  "<svg xmlns=\"http://www.w3.org/2000/svg\">\n<defs>\n");
+  for (auto& def : mDefs) {
+    svg += def.second;
+  }
+  svg += "</defs>\n</svg>\n";
+  writeFile(aPath, svg);
+}
+
+std::string formatSVGPage(const PageDisplayList& aPage,
+                          double aWidth, double aHeight, SVGGlyphs& aGlyphs) {
+  std::string svg("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                  "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+                  "xmlns:xlink=\"http://www.w3.org/1999/xlink\" width=\"");
+  appendNumber(svg, aWidth);
+  svg += "pt\" height=\"";
+  appendNumber(svg, aHeight);
+  svg += "pt\" viewBox=\"0 0 ";
+  appendNumber(svg, aWidth);
+  svg += ' ';
+  appendNumber(svg, aHeight);
+  svg += "\" version=\"1.1\">\n";
+
+  for (auto* runs : {&aPage.mRuns, &aPage.mAnnotations}) {
+    for (auto& run : *runs) {
+      uint32_t fontIndex = aGlyphs.define(run);
+      for (auto& glyph : run.mGlyphs) {
+        svg += "<use xlink:href=\"";
+        svg += kSVGGlyphsLeaf;
+        svg += '#';
+        appendGlyphId(svg, fontIndex, glyph.index);
+        svg += "\" x=\"";
+        appendNumber(svg, glyph.x);
+        svg += "\" y=\"";
+        appendNumber(svg, glyph.y);
+        svg += "\"/>\n";
+      }
+    }
+  }
+  svg += "</svg>\n";
+  return svg;
+}
+
+std::string compressSVG(std::string&& aSVG, int aLevel) {
+  if (0 == aLevel) {
+    return std::move(aSVG);
+  }
+  if (aLevel < 0 || aLevel > 9) {
+    throw std::runtime_error("Bad SVGZ level: " + std::to_string(aLevel));
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // 16 + 15: gzip wrapper around a 32 KiB window.
+  if (Z_OK != deflateInit2(&stream, aLevel, Z_DEFLATED,
+                           16 + 15, 8, Z_DEFAULT_STRATEGY)) {
+    throw std::runtime_error("deflateInit2 failed");
+  }
+  stream.next_in = reinterpret_cast<Bytef*>(&aSVG[0]);
+  stream.avail_in = aSVG.size();
+
+  std::string svgz;
+  char buffer[16384];
+  int status;
+  do {
+    stream.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream.avail_out = sizeof(buffer);
+    status = deflate(&stream, Z_FINISH);
+    svgz.append(buffer, sizeof(buffer) - stream.avail_out);
+  } while (Z_OK == status);
+  deflateEnd(&stream);
+
+  if (Z_STREAM_END != status) {
+    throw std::runtime_error("deflate failed");
+  }
+  return svgz;
+}
+
+void writeSVGPage(const PageDisplayList& aPage, double aWidth, double aHeight,
+                  SVGGlyphs& aGlyphs, const char* aPath, int aLevel) {
+  writeFile(aPath, compressSVG(formatSVGPage(aPage, aWidth, aHeight, aGlyphs),
+                               aLevel));
+}
+
+SVGArchive::SVGArchive(const char* aPath)
+  : mFile(fopen(aPath, "wb")), mPath(aPath), mNext(0), mOffsets(1, 0),
+    mError(0) {
+  if (!mFile) {
+    throw std::runtime_error(mPath + ": " + strerror(errno));
+  }
+}
+
+SVGArchive::~SVGArchive() {
+  if (mFile) {
+    fclose(mFile);
+  }
+}
+
+void SVGArchive::add(uint32_t aIndex, std::string&& aPage) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  mPending[aIndex] = std::move(aPage);
+
+  auto next = mPending.begin();
+  while (next != mPending.end() && next->first == mNext) {
+    const std::string& page = next->second;
+    if (0 == mError &&
+        page.size() != fwrite(page.data(), 1, page.size(), mFile)) {
+      mError = errno;
+    }
+    mOffsets.push_back(mOffsets.back() + page.size());
+    mNext++;
+    next = mPending.erase(next);
+  }
+}
+
+void SVGArchive::finish() {
+  FILE* file = mFile;
+  mFile = nullptr;
+  if (!file) {
+    return;
+  }
+  if (0 != fclose(file) && 0 == mError) {
+    mError = errno;
+  }
+  if (mError) {
+    throw std::runtime_error(mPath + ": " + strerror(mError));
+  }
+  if (!mPending.empty()) {
+    throw std::runtime_error(mPath + ": Missing pages");
+  }
+}
+
+} // azlayout
@@ -0,0 +1,128 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _AZLAYOUT_SVGWRITER_
+#define _AZLAYOUT_SVGWRITER_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include "azlayout.h"
+
+namespace azlayout {
+
+// SVG pages are written straight from PageDisplayList instead of through
+// cairo. Every glyph outline goes into a single "glyphs.svg" next to the
+// pages, once for the whole book, and the pages only <use> them by position:
+//
+//   <use xlink:href="glyphs.svg#g0-1234" x="520.5" y="40"/>
+//
+// The outlines are already transformed by Font::mMatrix, so the id is made
+// of the font (its index in DisplayList::mFonts) and the glyph index. Both
+// are the same in every run with the same settings, so pages from an
+// earlier run can share glyphs.svg with the pages of a later one.
+extern const char kSVGGlyphsLeaf[];
+
+class SVGGlyphs {
+  std::mutex mMutex; // For |mDefs|.
+  const std::vector<Font*> mFonts;
+  // One for each of |mFonts|, as Font::loadOutline() can't be called on
+  // several threads at a time.
+  std::vector<std::mutex> mLoadMutexes;
+  // <path> elements keyed by (font, glyph), so that they are written in the
+  // same order whichever thread defines them first.
+  std::map<uint64_t, std::string> mDefs;
+
+  std::string defineGlyph(const Font* aFont, uint32_t aFontIndex,
+                          uint32_t aGlyph);
+  void read(const char* aPath);
+public:
+  // |aFonts| number the fonts in the ids, as DisplayList::mFonts does.
+  explicit SVGGlyphs(const std::vector<Font*>& aFonts)
+    : mFonts(aFonts), mLoadMutexes(aFonts.size()) {}
+
+  // Load the outlines of |aRun| not seen yet. Pages may be written by
+  // several threads at a time, and they share this. This throws
+  // std::runtime_error if the font of |aRun| isn't one of |mFonts|.
+  // @return  The index of the font of |aRun| in the ids.
+  uint32_t define(const GlyphRun& aRun);
+
+  // Write every outline defined so far. With |aMerge|, the ones already in
+  // |aPath| are kept too, for the pages which use them. This throws
+  // std::runtime_error on I/O errors.
+  void write(const char* aPath, bool aMerge = false);
+};
+
+// |aPage| as an SVG document, defining its glyphs in |aGlyphs|. Only ASCII
+// is used, so byte offsets are character offsets as well.
+std::string formatSVGPage(const PageDisplayList& aPage,
+                          double aWidth, double aHeight, SVGGlyphs& aGlyphs);
+
+// |aSVG| as SVGZ, i.e. gzip, at zlib's |aLevel| (1 to 9), or as is for 0.
+// Other levels throw std::runtime_error.
+// Every page is a gzip stream of its own, so that it can be cut out of an
+// SVGArchive and inflated alone.
+std::string compressSVG(std::string&& aSVG, int aLevel);
+
+// formatSVGPage() into the file |aPath|, compressed at |aLevel| as
+// compressSVG() does. This throws std::runtime_error on I/O errors.
+void writeSVGPage(const PageDisplayList& aPage, double aWidth, double aHeight,
+                  SVGGlyphs& aGlyphs, const char* aPath, int aLevel = 0);
+
+// All the pages of a book in one file, one after another, instead of a file
+// each. Pages may come in any order from several threads, and are written
+// in page order as soon as the ones before them are in, so the file is
+// written sequentially. |offsets()| tells where each page starts, plus the
+// end of the last one, for info.json; viewers fetch pages by byte range.
+class SVGArchive {
+  FILE* mFile;
+  std::string mPath;
+  std::mutex mMutex;
+  std::map<uint32_t, std::string> mPending;
+  uint32_t mNext;
+  std::vector<uint64_t> mOffsets;
+  // The first errno fwrite() gave us.
+  int mError;
+public:
+  // Create (or truncate) |aPath|. This throws std::runtime_error if it can't.
+  explicit SVGArchive(const char* aPath);
+  ~SVGArchive();
+  SVGArchive(const SVGArchive&) = delete;
+  SVGArchive& operator=(const SVGArchive&) = delete;
+
+  // Page |aIndex|, counted from zero.
+  void add(uint32_t aIndex, std::string&& aPage);
+
+  // Close the file. This throws std::runtime_error on I/O errors or if a
+  // page is missing.
+  void finish();
+
+  const std::vector<uint64_t>& offsets() const {
+    return mOffsets;
+  }
+};
+
+} // azlayout
+#endif
@@ -0,0 +1,290 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "utf8.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define AZ_UTF8_SSE2 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define AZ_UTF8_AVX2 1
+#endif
+
+namespace azlayout {
+
+namespace {
+
+const uint32_t kReplacement = 0xFFFD;
+
+// @return  The byte length of the code point at |aData|, which is 1 for
+//          invalid sequences.
+inline uint32_t decodeOne(const uint8_t* aData, uint32_t aLeft,
+                          uint32_t& aCodepoint) {
+  const uint8_t c = aData[0];
+  if (c < 0x80) {
+    aCodepoint = c;
+    return 1;
+  }
+
+  uint32_t length;
+  uint8_t min = 0x80, max = 0xBF; // for the second byte.
+  if (c >= 0xC2 && c <= 0xDF) {
+    length = 2;
+    aCodepoint = c & 0x1F;
+  }
+  else if (c >= 0xE0 && c <= 0xEF) {
+    length = 3;
+    aCodepoint = c & 0x0F;
+    if (0xE0 == c) {
+      min = 0xA0; // overlong
+    }
+    else if (0xED == c) {
+      max = 0x9F; // surrogates
+    }
+  }
+  else if (c >= 0xF0 && c <= 0xF4) {
+    length = 4;
+    aCodepoint = c & 0x07;
+    if (0xF0 == c) {
+      min = 0x90; // overlong
+    }
+    else if (0xF4 == c) {
+      max = 0x8F; // beyond U+10FFFF
+    }
+  }
+  else {
+    aCodepoint = kReplacement;
+    return 1;
+  }
+
+  if (aLeft < length || aData[1] < min || aData[1] > max) {
+    aCodepoint = kReplacement;
+    return 1;
+  }
+  for (uint32_t i = 1; i < length; i++) {
+    if (0x80 != (aData[i] & 0xC0)) {
+      aCodepoint = kReplacement;
+      return 1;
+    }
+    aCodepoint = (aCodepoint << 6) | (aData[i] & 0x3F);
+  }
+  return length;
+}
+
+// Every decoder below decodes |aData| from |aStart| into |aCodepoints| and
+// |aOffsets|, both of which have room for |aLength - aStart| entries, and
+// returns how many code points it wrote.
+uint32_t decodeScalar(const uint8_t* aData, uint32_t aLength, uint32_t aStart,
+                      uint32_t* aCodepoints, uint32_t* aOffsets) {
+  uint32_t written = 0;
+  uint32_t i = aStart;
+  while (i < aLength) {
+    aOffsets[written] = i;
+    i += decodeOne(aData + i, aLength - i, aCodepoints[written]);
+    written++;
+  }
+  return written;
+}
+
+#ifdef AZ_UTF8_SSE2
+// Five 3-byte sequences in a row, none of which starts with E0 or ED (their
+// second bytes have narrower ranges). Kanji and Kana are all there.
+inline bool decodeThreeByteRun(const uint8_t* aData, uint32_t aOffset,
+                               uint32_t* aCodepoints, uint32_t* aOffsets) {
+  const __m128i mask = _mm_setr_epi8(char(0xF0), char(0xC0), char(0xC0),
+                                     char(0xF0), char(0xC0), char(0xC0),
+                                     char(0xF0), char(0xC0), char(0xC0),
+                                     char(0xF0), char(0xC0), char(0xC0),
+                                     char(0xF0), char(0xC0), char(0xC0), 0);
+  const __m128i pattern = _mm_setr_epi8(char(0xE0), char(0x80), char(0x80),
+                                        char(0xE0), char(0x80), char(0x80),
+                                        char(0xE0), char(0x80), char(0x80),
+                                        char(0xE0), char(0x80), char(0x80),
+                                        char(0xE0), char(0x80), char(0x80), 0);
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aData));
+  __m128i matched = _mm_cmpeq_epi8(_mm_and_si128(v, mask), pattern);
+  // Continuation bytes are never E0 nor ED, so these can only be leads.
+  __m128i narrow = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(char(0xE0))),
+                                _mm_cmpeq_epi8(v, _mm_set1_epi8(char(0xED))));
+  if (0x7FFF != (_mm_movemask_epi8(matched) & 0x7FFF) ||
+      0 != (_mm_movemask_epi8(narrow) & 0x7FFF)) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < 5; i++) {
+    const uint8_t* p = aData + i * 3;
+    aCodepoints[i] = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) |
+                     (p[2] & 0x3F);
+    aOffsets[i] = aOffset + i * 3;
+  }
+  return true;
+}
+
+uint32_t decodeSSE2(const uint8_t* aData, uint32_t aLength, uint32_t aStart,
+                    uint32_t* aCodepoints, uint32_t* aOffsets) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i steps = _mm_setr_epi32(0, 1, 2, 3);
+  uint32_t written = 0;
+  uint32_t i = aStart;
+  while (i + 16 <= aLength) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aData + i));
+    if (0 == _mm_movemask_epi8(v)) {
+      __m128i half[2] = { _mm_unpacklo_epi8(v, zero),
+                          _mm_unpackhi_epi8(v, zero) };
+      for (uint32_t j = 0; j < 4; j++) {
+        __m128i codepoints = (j & 1)?
+          _mm_unpackhi_epi16(half[j >> 1], zero) :
+          _mm_unpacklo_epi16(half[j >> 1], zero);
+        __m128i offsets = _mm_add_epi32(_mm_set1_epi32(i + j * 4), steps);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(aCodepoints + written),
+                         codepoints);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(aOffsets + written),
+                         offsets);
+        written += 4;
+      }
+      i += 16;
+    }
+    else if (decodeThreeByteRun(aData + i, i, aCodepoints + written,
+                                aOffsets + written)) {
+      written += 5;
+      i += 15;
+    }
+    else {
+      aOffsets[written] = i;
+      i += decodeOne(aData + i, aLength - i, aCodepoints[written]);
+      written++;
+    }
+  }
+  return written + decodeScalar(aData, aLength, i,
+                                aCodepoints + written, aOffsets + written);
+}
+#endif
+
+#if defined(AZ_UTF8_SSE2) && defined(AZ_UTF8_AVX2)
+__attribute__((target("avx2")))
+uint32_t decodeAVX2(const uint8_t* aData, uint32_t aLength, uint32_t aStart,
+                    uint32_t* aCodepoints, uint32_t* aOffsets) {
+  const __m256i steps = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  uint32_t written = 0;
+  uint32_t i = aStart;
+  while (i + 32 <= aLength) {
+    __m256i v =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(aData + i));
+    if (0 == _mm256_movemask_epi8(v)) {
+      for (uint32_t j = 0; j < 4; j++) {
+        __m128i bytes =
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(aData + i + j * 8));
+        __m256i codepoints = _mm256_cvtepu8_epi32(bytes);
+        __m256i offsets = _mm256_add_epi32(_mm256_set1_epi32(i + j * 8), steps);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(aCodepoints + written),
+                            codepoints);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(aOffsets + written),
+                            offsets);
+        written += 8;
+      }
+      i += 32;
+    }
+    else if (decodeThreeByteRun(aData + i, i, aCodepoints + written,
+                                aOffsets + written)) {
+      written += 5;
+      i += 15;
+    }
+    else {
+      aOffsets[written] = i;
+      i += decodeOne(aData + i, aLength - i, aCodepoints[written]);
+      written++;
+    }
+  }
+  // Less than 32 bytes left.
+  return written + decodeSSE2(aData, aLength, i,
+                              aCodepoints + written, aOffsets + written);
+}
+#endif
+
+typedef uint32_t (*Decoder)(const uint8_t*, uint32_t, uint32_t,
+                            uint32_t*, uint32_t*);
+
+Decoder selectDecoder() {
+#if defined(AZ_UTF8_SSE2) && defined(AZ_UTF8_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return decodeAVX2;
+  }
+#endif
+#ifdef AZ_UTF8_SSE2
+  return decodeSSE2;
+#else
+  return decodeScalar;
+#endif
+}
+
+} // namespace
+
+void decodeUTF8(const char* aData, uint32_t aLength, DecodedUTF8& aDecoded) {
+  static const Decoder decoder = selectDecoder();
+
+  // There are never more code points than bytes.
+  aDecoded.mCodepoints.resize(aLength);
+  aDecoded.mOffsets.resize(aLength + 1);
+  uint32_t length = decoder(reinterpret_cast<const uint8_t*>(aData), aLength, 0,
+                            aDecoded.mCodepoints.data(),
+                            aDecoded.mOffsets.data());
+  aDecoded.mCodepoints.resize(length);
+  aDecoded.mOffsets.resize(length + 1);
+  aDecoded.mOffsets[length] = aLength;
+}
+
+uint32_t chunkEndUTF8(const char* aData, uint32_t aLength, uint32_t aEnd) {
+  if (aEnd >= aLength) {
+    return aLength;
+  }
+  auto isContinuation = [aData](uint32_t aOffset) {
+    return 0x80 == (uint8_t(aData[aOffset]) & 0xC0);
+  };
+
+  // Back up to the byte which starts the sequence. A sequence has 3
+  // continuation bytes at most, so if there are more, no valid one is cut.
+  uint32_t end = aEnd;
+  for (uint32_t i = 0; i < 3 && end > 0 && isContinuation(end); i++) {
+    end--;
+  }
+  if (end > 0 && !isContinuation(end)) {
+    return end;
+  }
+  // Too short to end before it, so end after it.
+  end = aEnd;
+  for (uint32_t i = 0; i < 3 && end < aLength && isContinuation(end); i++) {
+    end++;
+  }
+  return end;
+}
+
+uint32_t decodeFirstUTF8(const char* aData, uint32_t aLength) {
+  uint32_t codepoint;
+  decodeOne(reinterpret_cast<const uint8_t*>(aData), aLength, codepoint);
+  return codepoint;
+}
+
+} // azlayout
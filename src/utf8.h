@@ -0,0 +1,54 @@
+/*
+ *    Copyright (C) 2014 Torisugari <torisugari@gmail.com>
+ *
+ *     Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ *     The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#ifndef _AZLAYOUT_UTF8_
+#define _AZLAYOUT_UTF8_
+
+#include <stdint.h>
+#include <vector>
+
+namespace azlayout {
+
+// Code points of UTF-8 text and where they start. |mOffsets| has one more
+// entry than |mCodepoints|, the length of the text, so that the byte length
+// of the i-th code point is always mOffsets[i + 1] - mOffsets[i].
+struct DecodedUTF8 {
+  std::vector<uint32_t> mCodepoints;
+  std::vector<uint32_t> mOffsets;
+  uint32_t length() const { return mCodepoints.size(); }
+};
+
+// Decode |aData| as harfbuzz does: a byte which doesn't start a valid
+// sequence (overlong, surrogate, beyond U+10FFFF or truncated) becomes
+// U+FFFD on its own. Runs of ASCII and of 3-byte characters (most of
+// Japanese) are decoded with SSE2 or AVX2, whichever the CPU has.
+void decodeUTF8(const char* aData, uint32_t aLength, DecodedUTF8& aDecoded);
+
+// Where a chunk of |aData| (|aLength| bytes) ending at or before |aEnd| can
+// end without cutting a valid sequence in two, so that decoding chunk after
+// chunk gives the same code points as decoding the whole at once.
+uint32_t chunkEndUTF8(const char* aData, uint32_t aLength, uint32_t aEnd);
+
+// The first code point of |aData|, as decodeUTF8() would decode it.
+uint32_t decodeFirstUTF8(const char* aData, uint32_t aLength);
+
+} // azlayout
+#endif
@@ -30,7 +30,27 @@ enum property {
   Tu = 0x3
 };
 
-property getProperty(unsigned int aUnicodeCodePoint);
+// Generated by vo.js. gStage1 maps every 256 code points to a block of
+// gStage2, where a code point takes 2 bits. The last entry is for all the
+// code points beyond U+10FFFF.
+const unsigned int kStage1Length = (0x110000 >> 8) + 1;
+extern const unsigned char gStage1[kStage1Length];
+extern const unsigned char gStage2[];
+
+inline property getProperty(unsigned int aUnicodeCodePoint) {
+  unsigned int block = aUnicodeCodePoint >> 8;
+  block = (block < kStage1Length)? block : kStage1Length - 1;
+  unsigned int index = (gStage1[block] << 6) | ((aUnicodeCodePoint & 0xff) >> 2);
+  return property((gStage2[index] >> ((aUnicodeCodePoint & 3) << 1)) & 3);
+}
+
+// Binary search on the ranges of VerticalOrientation-*.txt. This is what
+// getProperty() used to be, and is kept to check the table above.
+property getPropertyReference(unsigned int aUnicodeCodePoint);
+
+// @return  The first code point on which getProperty() and
+//          getPropertyReference() disagree, or 0x110000 if none.
+unsigned int firstMismatch();
 
 }
 #endif